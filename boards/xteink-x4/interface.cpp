@@ -136,6 +136,19 @@ static X4Button readX4Buttons() {
     return X4_NONE;
 }
 
+/***************************************************************************************
+** Function name: _check_launcher_chord()
+** Location: main.cpp
+** Description:   Confirm held at power on keeps the Launcher open with fast boot on
+***************************************************************************************/
+bool _check_launcher_chord() {
+    for (int i = 0; i < 3; i++) { // the ladder settles right after power on
+        if (readX4Buttons() == X4_CONFIRM) return true;
+        delay(5);
+    }
+    return false;
+}
+
 /*********************************************************************
 ** Function: InputHandler
 ** Handles the variables PrevPress, NextPress, SelPress, AnyKeyPress and EscPress
@@ -30,6 +30,14 @@ struct Option {
 
 extern std::vector<Option> options;
 
+// Firmware of the hub catalog page being browsed, only what the list shows
+struct CatalogItem {
+    String name;
+    String author;
+    String fid;
+    bool star;
+};
+
 struct MenuOptions {
     String name;
     String text;
@@ -193,6 +201,10 @@ extern String dwn_path;
 
 extern String hub_url;
 
+extern std::vector<String> hub_mirrors; // used when hub_url is slow or down
+
+extern std::vector<String> cdn_mirrors; // firmware CDNs besides the M5Burner one
+
 extern int currentIndex;
 
 extern uint16_t total_firmware; // Number of available firmware on the list
@@ -201,7 +213,9 @@ extern uint8_t current_page; // Current Page
 
 extern uint8_t num_pages; // Number of pages (total fw/fw per page)
 
-extern JsonDocument doc;
+extern std::vector<CatalogItem> catalog; // Firmware of the current page
+
+extern uint8_t catalog_page_size; // Firmware per page
 
 extern JsonArray favorite;
 
@@ -225,6 +239,9 @@ extern bool update;
 // Used to choose SPIFFS or not
 extern bool askSpiffs;
 
+// Starts the installed app right away at power on, see setup()
+extern bool fastBoot;
+
 // size o the file in the webInterface
 extern size_t file_size;
 
@@ -19,6 +19,14 @@ void _setup_gpio();
 ***************************************************************************************/
 void _post_setup_gpio();
 
+/***************************************************************************************
+** Function name: _check_launcher_chord()
+** Location: main.cpp
+** Description:   true while the buttons that keep the Launcher open at power on are
+**                held, read before the display starts when fast boot is on
+***************************************************************************************/
+bool _check_launcher_chord();
+
 /***************************************************************************************
 ** Function name: getBattery()
 ** location: display.cpp
@@ -11,6 +11,7 @@
 #include <MD5Builder.h>
 #include <functional>
 #include "esp_partition.h"
+#include "mbedtls/sha256.h"
 
 #define UPDATE_ERROR_OK                 (0)
 #define UPDATE_ERROR_WRITE              (1)
@@ -25,11 +26,13 @@
 #define UPDATE_ERROR_NO_PARTITION       (10)
 #define UPDATE_ERROR_BAD_ARGUMENT       (11)
 #define UPDATE_ERROR_ABORT              (12)
+#define UPDATE_ERROR_SHA256             (13)
 
 #define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
 
 #define U_FLASH   0
 #define U_SPIFFS  100
+#define U_FAT     500   // FAT data partition, found by the label given to begin(), apart from U_FAT_vfs/U_FAT_sys
 #define U_AUTH    200
 
 #define ENCRYPTED_BLOCK_SIZE 16
@@ -37,6 +40,24 @@
 #define SPI_SECTORS_PER_BLOCK   16      // usually large erase block is 32k/64k
 #define SPI_FLASH_BLOCK_SIZE    (SPI_SECTORS_PER_BLOCK*SPI_FLASH_SEC_SIZE)
 
+// Bytes gathered before they are written, a multiple of SPI_FLASH_SEC_SIZE.
+// Halved until the allocation succeeds, down to a single sector
+#ifndef UPDATE_BUFFER_SIZE
+#define UPDATE_BUFFER_SIZE      (4*SPI_FLASH_SEC_SIZE)
+#endif
+#ifndef UPDATE_BUFFER_SIZE_PSRAM
+#define UPDATE_BUFFER_SIZE_PSRAM SPI_FLASH_BLOCK_SIZE
+#endif
+
+// Erase the next block in a helper task while the current one is filled. Off by
+// default: the cache (and the code outside IRAM) is stalled during an erase, on
+// single core chips nothing overlaps with it. Not used with setSkipIdentical(),
+// which has to compare a block before deciding to erase it
+#ifndef UPDATE_ERASE_AHEAD
+#define UPDATE_ERASE_AHEAD      0
+#endif
+#define UPDATE_ERASE_STACK      3072
+
 class UpdateClass {
   public:
     typedef std::function<void(size_t, size_t)> THandlerFunction_Progress;
@@ -108,6 +129,38 @@ class UpdateClass {
     */
     void md5(uint8_t * result){ return _md5.getBytes(result); }
 
+    /*
+      sets the expected SHA-256 of the app image (hexString), the digest
+      esp_partition_get_sha256() gives once it is installed. Call after begin()
+    */
+    bool setSHA256(const char * expected_sha256);
+
+    /*
+      Hash app images as they are written (SHA peripheral through mbedtls) and
+      check the digest appended to the image and the one given to setSHA256().
+      On mismatch end() fails and the partition isn't made bootable.
+      Enabled by default, kept across begin() calls
+    */
+    void setVerify(bool enable){ _verify = enable; }
+
+    /*
+      returns the SHA-256 String of the successfully verified app image
+    */
+    String sha256String(void);
+
+    /*
+      Compare every sector with the flash before erasing it, identical sectors are
+      neither erased nor written again. Enabled by default, kept across begin() calls
+    */
+    void setSkipIdentical(bool enable){ _skipIdentical = enable; }
+
+    /*
+      Sectors left untouched because the flash already had the same data, and
+      sectors that were programmed, during the current or last update
+    */
+    size_t skippedSectors(){ return _sectorsSkipped; }
+    size_t writtenSectors(){ return _sectorsWritten; }
+
     //Helpers
     uint8_t getError(){ return _error; }
     void clearError(){ _error = UPDATE_ERROR_OK; }
@@ -135,8 +188,8 @@ class UpdateClass {
         if(_bufferLen + available > remaining()){
           available = remaining() - _bufferLen;
         }
-        if(_bufferLen + available > 4096) {
-          size_t toBuff = 4096 - _bufferLen;
+        if(_bufferLen + available > _bufferSize) {
+          size_t toBuff = _bufferSize - _bufferLen;
           data.read(_buffer + _bufferLen, toBuff);
           _bufferLen += toBuff;
           if(!_writeBuffer())
@@ -172,16 +225,25 @@ class UpdateClass {
     void _reset();
     void _abort(uint8_t err);
     bool _writeBuffer();
+    bool _prepareSector(size_t progress, const uint8_t *data, size_t len, bool header, bool &write);
+    bool _writeRun(size_t pos, size_t len, uint8_t skip);
+    bool _eraseAheadWait(size_t progress);
+    void _shaAdd(const uint8_t *data, size_t len);
+    bool _shaCheck();
+    void _eraseAheadStart(size_t progress);
+    static void _eraseLoop(void *arg);
     bool _verifyHeader(uint8_t data);
     bool _verifyEnd();
     bool _enablePartition(const esp_partition_t* partition);
     bool _chkDataInBlock(const uint8_t *data, size_t len) const;    // check if block contains any data or is empty
+    bool _flashMatches(size_t offset, const uint8_t *data, size_t len) const;   // check if flash already holds this data
 
 
     uint8_t _error;
     uint8_t *_buffer;
     uint8_t *_skipBuffer;
     size_t _bufferLen;
+    size_t _bufferSize;
     size_t _size;
     THandlerFunction_Progress _progress_callback;
     uint32_t _progress;
@@ -194,6 +256,30 @@ class UpdateClass {
 
     int _ledPin;
     uint8_t _ledOn;
+
+    bool _skipIdentical;
+    bool _blockErased;
+    size_t _sectorsSkipped;
+    size_t _sectorsWritten;
+
+    TaskHandle_t _eraseTask;
+    SemaphoreHandle_t _eraseDone;
+    size_t _eraseAhead;             // partition offset of the block being erased, or SIZE_MAX
+    bool _eraseOk;
+
+    bool _verify;
+    bool _shaActive;
+    bool _shaBad;                   // not an image the digest can be followed in
+    bool _shaAppended;
+    bool _shaExpected;
+    uint8_t _shaSegments;           // segment headers still to come
+    size_t _shaNext;                // position of the next segment header
+    size_t _shaEnd;                 // end of the hashed bytes, SIZE_MAX until known
+    uint8_t _shaSegment[8];
+    uint8_t _shaImage[32];          // digest appended to the image
+    uint8_t _shaTarget[32];
+    uint8_t _shaDigest[32];
+    mbedtls_sha256_context _sha;
 };
 
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_UPDATE)
@@ -9,6 +9,7 @@
 #include "esp_spi_flash.h"
 #include "esp_ota_ops.h"
 #include "esp_image_format.h"
+#include "esp_heap_caps.h"
 
 static const char * _err2str(uint8_t _error){
     if(_error == UPDATE_ERROR_OK){
@@ -37,10 +38,22 @@ static const char * _err2str(uint8_t _error){
         return ("Bad Argument");
     } else if(_error == UPDATE_ERROR_ABORT){
         return ("Aborted");
+    } else if(_error == UPDATE_ERROR_SHA256){
+        return ("SHA-256 Check Failed");
     }
     return ("UNKNOWN");
 }
 
+// app image layout, see esp_image_format.h
+#define IMAGE_HEADER_LEN        24
+#define IMAGE_SEGMENTS_POS      1
+#define IMAGE_HASH_APPENDED_POS 23
+#define IMAGE_SEGMENT_HDR_LEN   8
+
+static uint32_t _le32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 static bool _partitionIsBootable(const esp_partition_t* partition){
     uint8_t buf[ENCRYPTED_BLOCK_SIZE];
     if(!partition){
@@ -67,12 +80,23 @@ UpdateClass::UpdateClass()
 : _error(0)
 , _buffer(0)
 , _bufferLen(0)
+, _bufferSize(SPI_FLASH_SEC_SIZE)
 , _size(0)
 , _progress_callback(NULL)
 , _progress(0)
 , _paroffset(0)
 , _command(U_FLASH)
 , _partition(NULL)
+, _skipIdentical(true)
+, _blockErased(false)
+, _sectorsSkipped(0)
+, _sectorsWritten(0)
+, _eraseTask(NULL)
+, _eraseDone(NULL)
+, _eraseAhead(SIZE_MAX)
+, _eraseOk(true)
+, _verify(true)
+, _shaActive(false)
 {
 }
 
@@ -82,9 +106,22 @@ UpdateClass& UpdateClass::onProgress(THandlerFunction_Progress fn) {
 }
 
 void UpdateClass::_reset() {
+    // the helper may still be erasing, it owns the flash range until it is done
+    _eraseAheadWait(SIZE_MAX);
+    if (_eraseTask) {
+        vTaskDelete(_eraseTask);
+        _eraseTask = NULL;
+    }
+    if (_eraseDone) {
+        vSemaphoreDelete(_eraseDone);
+        _eraseDone = NULL;
+    }
     if (_buffer)
-        delete[] _buffer;
+        free(_buffer);
     _buffer = 0;
+    if (_shaActive)
+        mbedtls_sha256_free(&_sha);
+    _shaActive = false;
     _bufferLen = 0;
     _progress = 0;
     _size = 0;
@@ -124,6 +161,9 @@ bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, con
     _error = 0;
     _target_md5 = emptyString;
     _md5 = MD5Builder();
+    _blockErased = false;
+    _sectorsSkipped = 0;
+    _sectorsWritten = 0;
 
     if(size == 0) {
         _error = UPDATE_ERROR_SIZE;
@@ -150,6 +190,19 @@ bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, con
             }
         }
     }
+    else if (command == U_FAT) {
+        // without a label the first FAT partition would be taken, it can be sys
+        if(!label){
+            _error = UPDATE_ERROR_BAD_ARGUMENT;
+            return false;
+        }
+        _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, label);
+        if(!_partition){
+            _error = UPDATE_ERROR_NO_PARTITION;
+            return false;
+        }
+        log_d("FAT Partition: %s", _partition->label);
+    }
     else {
         _error = UPDATE_ERROR_BAD_ARGUMENT;
         log_e("bad command %u", command);
@@ -164,15 +217,51 @@ bool UpdateClass::begin(size_t size, int command, int ledPin, uint8_t ledOn, con
         return false;
     }
 
-    //initialize
-    _buffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
+    //initialize, PSRAM is preferred for the buffer, flash writes bounce through internal RAM anyway
+    size_t wanted = psramFound() ? UPDATE_BUFFER_SIZE_PSRAM : UPDATE_BUFFER_SIZE;
+    size_t needed = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    if (wanted > needed) wanted = needed;
+    for (_bufferSize = wanted; _bufferSize >= SPI_FLASH_SEC_SIZE; _bufferSize /= 2) {
+        if (psramFound())
+            _buffer = (uint8_t*)heap_caps_malloc(_bufferSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!_buffer)
+            _buffer = (uint8_t*)heap_caps_malloc(_bufferSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (_buffer)
+            break;
+    }
     if(!_buffer){
         log_e("malloc failed");
         return false;
     }
+    log_d("buffer: %u bytes", _bufferSize);
+
+#if UPDATE_ERASE_AHEAD
+    // same priority as the writer, it runs while the writer waits for its source.
+    // Blocks compared before erasing can't be erased ahead
+    if (!_skipIdentical || _partition->encrypted) {
+        _eraseDone = xSemaphoreCreateBinary();
+    }
+    if (_eraseDone && xTaskCreate(_eraseLoop, "updErase", UPDATE_ERASE_STACK, this, uxTaskPriorityGet(NULL), &_eraseTask) != pdPASS) {
+        _eraseTask = NULL;
+    }
+    if (_eraseDone && !_eraseTask) {
+        log_w("no erase-ahead, erasing inline");
+    }
+#endif
     _size = size;
     _command = command;
     _md5.begin();
+    _shaActive = _verify && command == U_FLASH;
+    _shaBad = false;
+    _shaAppended = false;
+    _shaExpected = false;
+    _shaSegments = 0;
+    _shaNext = 0;
+    _shaEnd = SIZE_MAX;
+    if (_shaActive) {
+        mbedtls_sha256_init(&_sha);
+        mbedtls_sha256_starts(&_sha, 0);
+    }
     return true;
 }
 
@@ -185,6 +274,114 @@ void UpdateClass::abort(){
     _abort(UPDATE_ERROR_ABORT);
 }
 
+void UpdateClass::_eraseLoop(void *arg){
+    UpdateClass *self = (UpdateClass*)arg;
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        self->_eraseOk = ESP.partitionEraseRange(self->_partition, self->_eraseAhead, SPI_FLASH_BLOCK_SIZE);
+        xSemaphoreGive(self->_eraseDone);
+    }
+}
+
+/*
+  Starts erasing the block after the one holding progress, when it is a whole
+  block of the update. Called once the current block was erased inline, a block
+  erased ahead doesn't start the next erase
+*/
+void UpdateClass::_eraseAheadStart(size_t progress){
+    if (!_eraseTask || _eraseAhead != SIZE_MAX) {
+        return;
+    }
+    size_t next = progress + SPI_FLASH_BLOCK_SIZE - (_partition->address + progress) % SPI_FLASH_BLOCK_SIZE;
+    if (next + SPI_FLASH_BLOCK_SIZE > _size) {
+        return;
+    }
+    _eraseAhead = next;
+    xTaskNotifyGive(_eraseTask);
+}
+
+/*
+  Waits for the erase in flight. Returns false if it failed, and marks the block
+  erased when it is the one starting at progress
+*/
+bool UpdateClass::_eraseAheadWait(size_t progress){
+    if (_eraseAhead == SIZE_MAX) {
+        return true;
+    }
+    xSemaphoreTake(_eraseDone, portMAX_DELAY);
+    bool ok = _eraseOk;
+    if (ok && _eraseAhead == progress) {
+        _blockErased = true;
+    }
+    _eraseAhead = SIZE_MAX;
+    return ok;
+}
+
+/*
+  Erases what the sector at progress needs, and tells whether it has to be written
+*/
+bool UpdateClass::_prepareSector(size_t progress, const uint8_t *data, size_t len, bool header, bool &write){
+    size_t offset = _partition->address + progress;
+    bool block_erase = (_size - progress >= SPI_FLASH_BLOCK_SIZE) && (offset % SPI_FLASH_BLOCK_SIZE == 0);             // if it's the block boundary, than erase the whole block from here
+    bool part_head_sectors = _partition->address % SPI_FLASH_BLOCK_SIZE && offset < (_partition->address / SPI_FLASH_BLOCK_SIZE + 1) * SPI_FLASH_BLOCK_SIZE;    // sector belong to unaligned partition heading block
+    bool part_tail_sectors = offset >= (_partition->address + _size) / SPI_FLASH_BLOCK_SIZE * SPI_FLASH_BLOCK_SIZE;     // sector belong to unaligned partition tailing block
+    write = true;
+
+    if (offset % SPI_FLASH_BLOCK_SIZE == 0) {
+        _blockErased = false;
+        if (!_eraseAheadWait(progress)) {
+            _abort(UPDATE_ERROR_ERASE);
+            return false;
+        }
+        if (_blockErased) {
+            return true;
+        }
+    }
+
+    if (_skipIdentical && !_partition->encrypted) {
+        // compare-before-erase: a new block is only erased as a whole when its first sector differs,
+        // otherwise every sector is checked against the flash and erased alone when needed.
+        // The first sector of an app is always rewritten, its header has to be the last thing enabled
+        if (!_blockErased) {
+            if (!header && _flashMatches(progress, data, len)) {
+                write = false;
+                _sectorsSkipped++;
+            } else {
+                bool whole_block = block_erase && !header;
+                if(!ESP.partitionEraseRange(_partition, progress, whole_block ? SPI_FLASH_BLOCK_SIZE : SPI_FLASH_SEC_SIZE)){
+                    _abort(UPDATE_ERROR_ERASE);
+                    return false;
+                }
+                _blockErased = whole_block;
+            }
+        }
+    } else if (block_erase || part_head_sectors || part_tail_sectors){
+        if(!ESP.partitionEraseRange(_partition, progress, block_erase ? SPI_FLASH_BLOCK_SIZE : SPI_FLASH_SEC_SIZE)){
+            _abort(UPDATE_ERROR_ERASE);
+            return false;
+        }
+        _blockErased = block_erase;
+    }
+    if (_blockErased) {
+        _eraseAheadStart(progress);
+    }
+    return true;
+}
+
+/*
+  Writes len bytes of the buffer, from pos, in a single call
+*/
+bool UpdateClass::_writeRun(size_t pos, size_t len, uint8_t skip){
+    if (!len) {
+        return true;
+    }
+    if (!ESP.partitionWrite(_partition, _progress + pos + skip, (uint32_t*)(_buffer + pos + skip), len - skip)) {
+        _abort(UPDATE_ERROR_WRITE);
+        return false;
+    }
+    return true;
+}
+
 bool UpdateClass::_writeBuffer(){
     //first bytes of new firmware
     uint8_t skip = 0;
@@ -209,20 +406,35 @@ bool UpdateClass::_writeBuffer(){
     if (!_progress && _progress_callback) {
         _progress_callback(0, _size);
     }
-    size_t offset = _partition->address + _progress;
-    bool block_erase = (_size - _progress >= SPI_FLASH_BLOCK_SIZE) && (offset % SPI_FLASH_BLOCK_SIZE == 0);             // if it's the block boundary, than erase the whole block from here
-    bool part_head_sectors = _partition->address % SPI_FLASH_BLOCK_SIZE && offset < (_partition->address / SPI_FLASH_BLOCK_SIZE + 1) * SPI_FLASH_BLOCK_SIZE;    // sector belong to unaligned partition heading block
-    bool part_tail_sectors = offset >= (_partition->address + _size) / SPI_FLASH_BLOCK_SIZE * SPI_FLASH_BLOCK_SIZE;     // sector belong to unaligned partition tailing block
-    if (block_erase || part_head_sectors || part_tail_sectors){
-        if(!ESP.partitionEraseRange(_partition, _progress, block_erase ? SPI_FLASH_BLOCK_SIZE : SPI_FLASH_SEC_SIZE)){
-            _abort(UPDATE_ERROR_ERASE);
+
+    // sectors are erased one after the other, then the ones to program are
+    // written in runs as long as possible
+    size_t run = 0, runLen = 0;
+    for (size_t pos = 0; pos < _bufferLen; pos += SPI_FLASH_SEC_SIZE) {
+        size_t len = _bufferLen - pos < SPI_FLASH_SEC_SIZE ? _bufferLen - pos : SPI_FLASH_SEC_SIZE;
+        bool header = skip && !pos;
+        bool write_sector;
+        if (!_prepareSector(_progress + pos, _buffer + pos, len, header, write_sector)) {
             return false;
         }
+        if (write_sector) {
+            _sectorsWritten++;
+        }
+        // try to skip empty blocks on unecrypted partitions
+        if (write_sector && !_partition->encrypted && !header && !_chkDataInBlock(_buffer + pos, len)) {
+            write_sector = false;
+        }
+        if (write_sector) {
+            if (!runLen) run = pos;
+            runLen += len;
+        } else {
+            if (!_writeRun(run, runLen, run ? 0 : skip)) {
+                return false;
+            }
+            runLen = 0;
+        }
     }
-
-    // try to skip empty blocks on unecrypted partitions
-    if ((_partition->encrypted || _chkDataInBlock(_buffer + skip/sizeof(uint32_t), _bufferLen - skip)) && !ESP.partitionWrite(_partition, _progress + skip, (uint32_t*)_buffer + skip/sizeof(uint32_t), _bufferLen - skip)) {
-        _abort(UPDATE_ERROR_WRITE);
+    if (!_writeRun(run, runLen, run ? 0 : skip)) {
         return false;
     }
 
@@ -231,6 +443,9 @@ bool UpdateClass::_writeBuffer(){
         _buffer[0] = ESP_IMAGE_HEADER_MAGIC;
     }
     _md5.add(_buffer, _bufferLen);
+    if (_shaActive) {
+        _shaAdd(_buffer, _bufferLen);
+    }
     _progress += _bufferLen;
     _bufferLen = 0;
     if (_progress_callback) {
@@ -246,7 +461,7 @@ bool UpdateClass::_verifyHeader(uint8_t data) {
             return false;
         }
         return true;
-    } else if(_command == U_SPIFFS) {
+    } else if(_command == U_SPIFFS || _command == U_FAT) {
         return true;
     }
     return false;
@@ -266,7 +481,7 @@ bool UpdateClass::_verifyEnd() {
         //}
         _reset();
         return true;
-    } else if(_command == U_SPIFFS) {
+    } else if(_command == U_SPIFFS || _command == U_FAT) {
         _reset();
         return true;
     }
@@ -282,6 +497,108 @@ bool UpdateClass::setMD5(const char * expected_md5){
     return true;
 }
 
+static bool _hexToBytes(const char *hex, uint8_t *out, size_t len){
+    for (size_t i = 0; i < len * 2; i++) {
+        char c = hex[i];
+        uint8_t v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+        else return false;
+        out[i / 2] = (i % 2) ? (out[i / 2] | v) : (v << 4);
+    }
+    return true;
+}
+
+bool UpdateClass::setSHA256(const char * expected_sha256){
+    if(!_shaActive || strlen(expected_sha256) != 64 || !_hexToBytes(expected_sha256, _shaTarget, sizeof(_shaTarget)))
+    {
+        return false;
+    }
+    _shaExpected = true;
+    return true;
+}
+
+String UpdateClass::sha256String(void){
+    char hex[sizeof(_shaDigest) * 2 + 1];
+    for (size_t i = 0; i < sizeof(_shaDigest); i++) {
+        sprintf(hex + i * 2, "%02x", _shaDigest[i]);
+    }
+    return String(hex);
+}
+
+/*
+  Hashes the image bytes in data, found at _progress. The digest covers the image
+  up to its padded end, which the segment headers tell as they go by, and is
+  followed by the appended one when the header says so
+*/
+void UpdateClass::_shaAdd(const uint8_t *data, size_t len){
+    size_t pos = _progress;
+    if (!pos) {
+        if (len < IMAGE_HEADER_LEN) {
+            _shaBad = true;
+            return;
+        }
+        _shaSegments = data[IMAGE_SEGMENTS_POS];
+        _shaAppended = data[IMAGE_HASH_APPENDED_POS] == 1;
+        _shaNext = IMAGE_HEADER_LEN;
+        if (!_shaSegments) _shaBad = true;
+    }
+    while (len && !_shaBad) {
+        size_t n = len;
+        if (_shaSegments && pos >= _shaNext) {
+            // segment header, its data length gives the position of the next one
+            if (n > _shaNext + IMAGE_SEGMENT_HDR_LEN - pos) n = _shaNext + IMAGE_SEGMENT_HDR_LEN - pos;
+            memcpy(_shaSegment + (pos - _shaNext), data, n);
+            if (pos + n == _shaNext + IMAGE_SEGMENT_HDR_LEN) {
+                uint32_t segment = _le32(&_shaSegment[4]);
+                if (segment > _size) {
+                    _shaBad = true;
+                    break;
+                }
+                _shaNext += IMAGE_SEGMENT_HDR_LEN + segment;
+                if (!--_shaSegments) _shaEnd = (_shaNext + 1 + 15) & ~15;   // checksum byte, padded to 16
+            }
+        } else if (_shaSegments) {
+            if (n > _shaNext - pos) n = _shaNext - pos;
+        } else if (pos < _shaEnd) {
+            if (n > _shaEnd - pos) n = _shaEnd - pos;
+        } else if (pos < _shaEnd + sizeof(_shaImage)) {
+            if (n > _shaEnd + sizeof(_shaImage) - pos) n = _shaEnd + sizeof(_shaImage) - pos;
+            memcpy(_shaImage + (pos - _shaEnd), data, n);
+        } else {
+            break;  // padding up to the end of the update
+        }
+        if (pos < _shaEnd) {
+            mbedtls_sha256_update(&_sha, data, n);
+        }
+        pos += n;
+        data += n;
+        len -= n;
+    }
+}
+
+bool UpdateClass::_shaCheck(){
+    if (!_shaActive) {
+        return true;
+    }
+    mbedtls_sha256_finish(&_sha, _shaDigest);
+    if (_shaBad || _shaSegments || _progress < _shaEnd + (_shaAppended ? sizeof(_shaImage) : 0)) {
+        log_e("not a whole app image");
+        return false;
+    }
+    if (_shaAppended && memcmp(_shaDigest, _shaImage, sizeof(_shaDigest))) {
+        log_e("image digest mismatch");
+        return false;
+    }
+    if (_shaExpected && memcmp(_shaDigest, _shaTarget, sizeof(_shaDigest))) {
+        log_e("SHA-256 mismatch, expected another image");
+        return false;
+    }
+    log_i("SHA-256: %s", sha256String().c_str());
+    return true;
+}
+
 bool UpdateClass::end(bool evenIfRemaining){
     if(hasError() || _size == 0){
         return false;
@@ -300,6 +617,7 @@ bool UpdateClass::end(bool evenIfRemaining){
         _size = progress();
     }
 
+    log_i("sectors written: %u, unchanged: %u", _sectorsWritten, _sectorsSkipped);
     _md5.calculate();
     if(_target_md5.length()) {
         if(_target_md5 != _md5.toString()){
@@ -307,6 +625,11 @@ bool UpdateClass::end(bool evenIfRemaining){
             return false;
         }
     }
+    // checked before the header is written, a bad image never becomes bootable
+    if(!_shaCheck()){
+        _abort(UPDATE_ERROR_SHA256);
+        return false;
+    }
 
     return _verifyEnd();
 }
@@ -323,8 +646,8 @@ size_t UpdateClass::write(uint8_t *data, size_t len) {
 
     size_t left = len;
 
-    while((_bufferLen + left) > SPI_FLASH_SEC_SIZE) {
-        size_t toBuff = SPI_FLASH_SEC_SIZE - _bufferLen;
+    while((_bufferLen + left) > _bufferSize) {
+        size_t toBuff = _bufferSize - _bufferLen;
         memcpy(_buffer + _bufferLen, data + (len - left), toBuff);
         _bufferLen += toBuff;
         if(!_writeBuffer()){
@@ -363,7 +686,7 @@ size_t UpdateClass::writeStream(Stream &data) {
         if(_ledPin != -1) {
             digitalWrite(_ledPin, _ledOn); // Switch LED on
         }
-        size_t bytesToRead = SPI_FLASH_SEC_SIZE - _bufferLen;
+        size_t bytesToRead = _bufferSize - _bufferLen;
         if(bytesToRead > remaining()) {
             bytesToRead = remaining();
         }
@@ -390,7 +713,7 @@ size_t UpdateClass::writeStream(Stream &data) {
             digitalWrite(_ledPin, !_ledOn); // Switch LED off
         }
         _bufferLen += toRead;
-        if((_bufferLen == remaining() || _bufferLen == SPI_FLASH_SEC_SIZE) && !_writeBuffer())
+        if((_bufferLen == remaining() || _bufferLen == _bufferSize) && !_writeBuffer())
             return written;
         written += toRead;
 
@@ -409,6 +732,18 @@ const char * UpdateClass::errorString(){
     return _err2str(_error);
 }
 
+bool UpdateClass::_flashMatches(size_t offset, const uint8_t *data, size_t len) const {
+    uint32_t chunk[64];
+    for (size_t pos = 0; pos < len; pos += sizeof(chunk)) {
+        size_t n = len - pos < sizeof(chunk) ? len - pos : sizeof(chunk);
+        if (!ESP.partitionRead(_partition, offset + pos, chunk, n))
+            return false;
+        if (memcmp(chunk, data + pos, n))
+            return false;
+    }
+    return true;
+}
+
 bool UpdateClass::_chkDataInBlock(const uint8_t *data, size_t len) const {
     // check 32-bit aligned blocks only
     if (!len || len % sizeof(uint32_t))
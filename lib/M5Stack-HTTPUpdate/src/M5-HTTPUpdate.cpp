@@ -421,7 +421,12 @@ bool HTTPUpdate::runUpdate(Stream &in, uint32_t size, String md5, int command) {
         }
     }
 
-    // To do: the SHA256 could be checked if the server sends it
+    if (command == U_FLASH && _sha256.length()) {
+        if (!Update.setSHA256(_sha256.c_str())) {
+            // not a digest, the one appended to the image is still checked
+            log_w("Update.setSHA256 failed! (%s)\n", _sha256.c_str());
+        }
+    }
 
     if (Update.writeStream(in) != size) {
         _lastError = Update.getError();
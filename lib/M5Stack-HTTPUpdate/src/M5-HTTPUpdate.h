@@ -85,6 +85,16 @@ public:
         _ledOn = ledOn;
     }
 
+    /**
+      * expected SHA-256 of the app image (hex, as esp_partition_get_sha256 gives it),
+      * checked as it is written. Empty to only check the digest appended to the image
+      * @param sha256
+      */
+    void setSHA256(const String& sha256)
+    {
+        _sha256 = sha256;
+    }
+
     t_httpUpdate_return update(WiFiClient& client, const String& url, const String& currentVersion = "", HTTPUpdateRequestCB requestCB = NULL);
 
     t_httpUpdate_return update(WiFiClient& client, const String& host, uint16_t port, const String& uri = "/",
@@ -139,6 +149,7 @@ private:
 
     int _ledPin;
     uint8_t _ledOn;
+    String _sha256;
 };
 
 #if !defined(NO_GLOBAL_INSTANCES) && !defined(NO_GLOBAL_HTTPUPDATE)
@@ -0,0 +1,176 @@
+#include "catalogCache.h"
+#include "gzStream.h"
+#include "sd_functions.h"
+#include <MD5Builder.h>
+#include <StreamString.h>
+#include <globals.h>
+#include <map>
+#include <set>
+
+struct RamEntry {
+    String key;
+    String etag;
+    String payload;
+};
+
+static std::map<String, uint32_t> fetchedAt; // key -> millis() of the last reply in this session
+static std::vector<RamEntry> ramCache;       // used when there is no SD card
+static std::set<String> usedFiles;           // cache files read or written in this session
+static int cacheFiles = -1;                  // files in CATALOG_CACHE_DIR, counted on the first store
+
+/*
+  Read only Stream over a String, to parse RAM entries without copying them
+*/
+class StringReader : public Stream {
+public:
+    StringReader(const String &s) : _s(s), _pos(0) {}
+
+    int available() override { return _s.length() - _pos; }
+    int read() override { return _pos < _s.length() ? (uint8_t)_s[_pos++] : -1; }
+    int peek() override { return _pos < _s.length() ? (uint8_t)_s[_pos] : -1; }
+    size_t readBytes(char *buffer, size_t length) override {
+        size_t n = _s.length() - _pos < length ? _s.length() - _pos : length;
+        memcpy(buffer, _s.c_str() + _pos, n);
+        _pos += n;
+        return n;
+    }
+    using Stream::readBytes;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    const String &_s;
+    size_t _pos;
+};
+
+static String cachePath(const String &key) {
+    MD5Builder md5;
+    md5.begin();
+    md5.add(key);
+    md5.calculate();
+    return String(CATALOG_CACHE_DIR) + "/" + md5.toString().substring(0, 16) + ".json";
+}
+
+/***************************************************************************************
+** Function name: cachePrune
+** Description:   counts the cache files, removing old ones over CATALOG_CACHE_FILES
+***************************************************************************************/
+static void cachePrune() {
+    std::vector<String> old;
+    File dir = SDM.open(CATALOG_CACHE_DIR);
+    if (!dir) return;
+    cacheFiles = 0;
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+        String path = String(CATALOG_CACHE_DIR) + "/" + file.name();
+        file.close();
+        if (!path.endsWith(".json")) continue;
+        cacheFiles++;
+        if (!usedFiles.count(path)) old.push_back(path);
+    }
+    dir.close();
+    for (const String &path : old) {
+        if (cacheFiles <= CATALOG_CACHE_FILES) break;
+        if (SDM.remove(path)) cacheFiles--;
+    }
+}
+
+static RamEntry *ramFind(const String &key) {
+    for (RamEntry &entry : ramCache)
+        if (entry.key == key) return &entry;
+    return nullptr;
+}
+
+/***************************************************************************************
+** Function name: catalogCacheLookup
+** Description:   true if key has a cached reply. fresh is true when it was fetched
+**                or revalidated within CATALOG_CACHE_TTL in this session.
+***************************************************************************************/
+bool catalogCacheLookup(const String &key, String &etag, bool &fresh) {
+    auto it = fetchedAt.find(key);
+    fresh = it != fetchedAt.end() && millis() - it->second < CATALOG_CACHE_TTL;
+
+    if (!sdcardMounted) {
+        RamEntry *entry = ramFind(key);
+        if (entry) etag = entry->etag;
+        return entry != nullptr;
+    }
+
+    // first line is the ETag, the reply follows
+    File file = SDM.open(cachePath(key), FILE_READ);
+    if (!file) return false;
+    etag = file.readStringUntil('\n');
+    bool ok = file.available() > 0;
+    file.close();
+    if (ok) usedFiles.insert(cachePath(key));
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: catalogCacheParse
+** Description:   runs parse over the cached reply of key
+***************************************************************************************/
+bool catalogCacheParse(const String &key, CatalogParser parse) {
+    if (!sdcardMounted) {
+        RamEntry *entry = ramFind(key);
+        if (!entry) return false;
+        StringReader reader(entry->payload);
+        return parse(reader);
+    }
+
+    File file = SDM.open(cachePath(key), FILE_READ);
+    if (!file) return false;
+    file.readStringUntil('\n'); // ETag
+    bool ok = parse(file);
+    file.close();
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: catalogCacheStore
+** Description:   runs parse over a reply from the network, keeping a copy of it.
+**                The copy replaces the cached one only if parse succeeds.
+***************************************************************************************/
+bool catalogCacheStore(const String &key, const String &etag, Stream &reply, CatalogParser parse) {
+    bool ok = false;
+
+    if (!sdcardMounted) {
+        StreamString copy;
+        TeeStream tee(reply, copy);
+        ok = parse(tee);
+        if (!ok || tee.failed()) return ok; // out of memory, parsed but not kept
+        RamEntry *entry = ramFind(key);
+        if (entry) ramCache.erase(ramCache.begin() + (entry - &ramCache[0]));
+        if (ramCache.size() >= CATALOG_RAM_ENTRIES) ramCache.erase(ramCache.begin());
+        ramCache.push_back({key, etag, copy});
+        fetchedAt[key] = millis();
+        return true;
+    }
+
+    if (!SDM.exists(CATALOG_CACHE_DIR)) SDM.mkdir(CATALOG_CACHE_DIR);
+    String path = cachePath(key);
+    File file = SDM.open(path + ".tmp", FILE_WRITE);
+    if (!file) return parse(reply); // SD full or read only, parse without caching
+    file.print(etag);
+    file.print('\n');
+    TeeStream tee(reply, file);
+    ok = parse(tee);
+    file.close();
+    if (ok && !tee.failed()) {
+        bool replaced = SDM.remove(path);
+        SDM.rename(path + ".tmp", path);
+        fetchedAt[key] = millis();
+        usedFiles.insert(path);
+        if (cacheFiles < 0 || (!replaced && ++cacheFiles > CATALOG_CACHE_FILES)) cachePrune();
+    } else SDM.remove(path + ".tmp");
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: catalogCacheTouch
+** Description:   the hub answered 304, the cached reply is good for another TTL
+***************************************************************************************/
+void catalogCacheTouch(const String &key) { fetchedAt[key] = millis(); }
+
+bool catalogCacheHas(const String &key) {
+    if (!sdcardMounted) return ramFind(key) != nullptr;
+    return SDM.exists(cachePath(key));
+}
@@ -0,0 +1,43 @@
+#ifndef __CATALOGCACHE_H
+#define __CATALOGCACHE_H
+#include <Arduino.h>
+#include <functional>
+
+// Hub replies (catalog pages and version documents) kept on the SD, one file per path
+#define CATALOG_CACHE_DIR "/.catalog"
+
+// Entries fetched or revalidated less than this ago (ms) are used without asking the hub
+#ifndef CATALOG_CACHE_TTL
+#define CATALOG_CACHE_TTL (10 * 60 * 1000)
+#endif
+
+// Cache files kept on the SD, the ones not used in this session are removed first
+#ifndef CATALOG_CACHE_FILES
+#define CATALOG_CACHE_FILES 64
+#endif
+
+// Without SD card the last replies are kept in RAM
+#ifndef CATALOG_RAM_ENTRIES
+#define CATALOG_RAM_ENTRIES 3
+#endif
+
+typedef std::function<bool(Stream &reply)> CatalogParser;
+
+/*
+  Cache of hub replies keyed by hub path, the same on every mirror, so a reply
+  cached from one mirror serves requests to another. Entries carry the ETag of the reply
+  so they can be revalidated with a conditional GET, and they stay usable with no
+  network at all. With an SD card replies are never held whole in memory: they
+  are parsed from the cache file, and stored while they are parsed from the network.
+*/
+bool catalogCacheLookup(const String &key, String &etag, bool &fresh);
+
+bool catalogCacheParse(const String &key, CatalogParser parse);
+
+bool catalogCacheStore(const String &key, const String &etag, Stream &reply, CatalogParser parse);
+
+void catalogCacheTouch(const String &key);
+
+bool catalogCacheHas(const String &key);
+
+#endif
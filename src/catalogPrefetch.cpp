@@ -0,0 +1,151 @@
+#include "catalogPrefetch.h"
+#include "catalogCache.h"
+#include "httpPool.h"
+#include "hubMirrors.h"
+#include <WiFi.h>
+
+static TaskHandle_t prefetchTask = NULL;
+static SemaphoreHandle_t queueLock = NULL; // guards queue, current and generation
+static SemaphoreHandle_t busy = NULL;      // held by the fetcher while it uses the network
+static std::vector<String> queue;          // hub paths, the catalog cache keys
+static String current = "";                // path being fetched
+static volatile uint32_t generation = 0;   // bumped to stop the fetch in flight
+static volatile bool quit = false;
+
+static bool stale(uint32_t gen) { return gen != generation || quit || WiFi.status() != WL_CONNECTED; }
+
+/***************************************************************************************
+** Function name: prefetchPath
+** Description:   gets a hub path into the catalog cache, unless it is there and recent
+***************************************************************************************/
+static void prefetchPath(const String &path, uint32_t gen) {
+    String etag = "";
+    bool fresh = false;
+    bool cached = catalogCacheLookup(path, etag, fresh);
+    if (fresh || stale(gen)) return;
+
+    String url = hubBase() + path;
+    const char *headerKeys[] = {"ETag"};
+    HTTPClient *http = nullptr;
+    int httpResponseCode = httpPoolGET(
+        http,
+        url,
+        [&](HTTPClient &request) {
+            if (cached && etag != "") request.addHeader("If-None-Match", etag);
+        },
+        headerKeys,
+        1
+    );
+    if (!http || httpResponseCode < 0 || httpResponseCode >= 500) {
+        if (!stale(gen)) mirrorFailed(url);
+        httpPoolEnd(http, false);
+        return;
+    }
+    if (httpResponseCode == HTTP_CODE_NOT_MODIFIED) {
+        httpPoolEnd(http);
+        catalogCacheTouch(path);
+        return;
+    }
+    if (httpResponseCode != HTTP_CODE_OK || stale(gen)) {
+        httpPoolEnd(http, false);
+        return;
+    }
+
+    // stored as it arrives, parsed by getInfo when the user asks for it
+    HttpBody body(http);
+    bool ok = catalogCacheStore(path, http->header("ETag"), body, [&](Stream &reply) {
+        char tmp[256];
+        while (!stale(gen) && reply.readBytes(tmp, sizeof(tmp)));
+        return body.finished() && !stale(gen);
+    });
+    httpPoolEnd(http, body.finished());
+    log_i("Prefetch: %s %s", ok ? "got" : "dropped", path.c_str());
+}
+
+static void prefetchLoop(void *pvParameters) {
+    while (!quit) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // wait for the selection to settle, scrolling keeps notifying
+        while (!quit && ulTaskNotifyTake(pdTRUE, PREFETCH_SETTLE / portTICK_PERIOD_MS));
+
+        while (!quit) {
+            xSemaphoreTake(busy, portMAX_DELAY);
+            xSemaphoreTake(queueLock, portMAX_DELAY);
+            uint32_t gen = generation;
+            current = "";
+            if (!queue.empty()) {
+                current = queue.front();
+                queue.erase(queue.begin());
+            }
+            String path = current;
+            xSemaphoreGive(queueLock);
+
+            if (path != "") prefetchPath(path, gen);
+
+            xSemaphoreTake(queueLock, portMAX_DELAY);
+            current = "";
+            xSemaphoreGive(queueLock);
+            xSemaphoreGive(busy);
+            if (path == "") break;
+        }
+    }
+    prefetchTask = NULL;
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************************
+** Function name: prefetchRequest
+** Description:   replaces the hub paths to fetch, in order of interest
+***************************************************************************************/
+void prefetchRequest(const std::vector<String> &paths) {
+    if (WiFi.status() != WL_CONNECTED) return;
+    if (!queueLock) {
+        queueLock = xSemaphoreCreateMutex();
+        busy = xSemaphoreCreateMutex();
+    }
+    if (!prefetchTask) {
+        quit = false;
+        if (xTaskCreate(prefetchLoop, "prefetch", PREFETCH_STACK, NULL, PREFETCH_PRIORITY, &prefetchTask) !=
+            pdPASS) {
+            prefetchTask = NULL;
+            return;
+        }
+    }
+
+    xSemaphoreTake(queueLock, portMAX_DELAY);
+    queue.clear();
+    bool keep = false;
+    for (const String &path : paths) {
+        if (path == current) keep = true;
+        else queue.push_back(path);
+    }
+    if (!keep) generation++;
+    xSemaphoreGive(queueLock);
+    xTaskNotifyGive(prefetchTask);
+}
+
+/***************************************************************************************
+** Function name: prefetchStop
+** Description:   the caller is about to use the network and the cache itself
+***************************************************************************************/
+void prefetchStop(const String &wanted) {
+    if (!prefetchTask) return;
+    xSemaphoreTake(queueLock, portMAX_DELAY);
+    queue.clear();
+    if (current == "" || current != wanted) generation++;
+    xSemaphoreGive(queueLock);
+    xSemaphoreTake(busy, portMAX_DELAY);
+    xSemaphoreGive(busy);
+}
+
+/***************************************************************************************
+** Function name: prefetchEnd
+** Description:   ends the fetcher task
+***************************************************************************************/
+void prefetchEnd() {
+    if (!prefetchTask) return;
+    prefetchStop();
+    quit = true;
+    xTaskNotifyGive(prefetchTask);
+    while (prefetchTask) vTaskDelay(10 / portTICK_PERIOD_MS);
+}
@@ -0,0 +1,37 @@
+#ifndef __CATALOGPREFETCH_H
+#define __CATALOGPREFETCH_H
+#include <Arduino.h>
+#include <vector>
+
+// The selection must stay this long (ms) on an entry before its requests are sent
+#ifndef PREFETCH_SETTLE
+#define PREFETCH_SETTLE 400
+#endif
+
+// Same priority as loopTask: loopOptions never blocks, a lower one would never run
+#ifndef PREFETCH_PRIORITY
+#define PREFETCH_PRIORITY 1
+#endif
+
+// Room for a TLS handshake
+#define PREFETCH_STACK 8192
+
+/*
+  Background fetcher of hub replies into the catalog cache. While a list is shown
+  it gets the requests the user is likely to make next (the next page, the versions
+  of the highlighted firmware), so they are answered from the cache when made.
+
+  Requests are hub paths (catalogPath, versionsPath), fetched from the best mirror.
+  Only the latest list is kept: a new request drops the queued paths and stops
+  the one in flight if it isn't in the new list.
+*/
+void prefetchRequest(const std::vector<String> &paths);
+
+// Drops the queued paths and waits for the fetcher to be idle. The path in flight
+// is left to finish when it is wanted, the one the user just asked for.
+void prefetchStop(const String &wanted = "");
+
+// Stops the fetcher task and frees its stack
+void prefetchEnd();
+
+#endif
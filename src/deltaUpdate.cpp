@@ -0,0 +1,191 @@
+#include "deltaUpdate.h"
+#include "display.h"
+#include <esp_image_format.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <globals.h>
+#include <mbedtls/sha256.h>
+
+#define DELTA_SECTOR 4096
+
+static uint32_t le32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+
+static bool readFull(Stream &source, uint8_t *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = source.readBytes(buf + done, len - done);
+        if (!n) return false;
+        done += n;
+    }
+    return true;
+}
+
+/*
+  Writes the rebuilt image to the scratch partition a sector at a time, erasing
+  each sector just before it is written, and hashes what goes through it
+*/
+struct DeltaWriter {
+    const esp_partition_t *partition;
+    uint8_t *sector;
+    size_t fill;
+    size_t offset;
+    mbedtls_sha256_context sha;
+
+    bool push(const uint8_t *data, size_t len) {
+        mbedtls_sha256_update(&sha, data, len);
+        while (len) {
+            size_t n = DELTA_SECTOR - fill < len ? DELTA_SECTOR - fill : len;
+            memcpy(sector + fill, data, n);
+            fill += n;
+            data += n;
+            len -= n;
+            if (fill == DELTA_SECTOR && !flush()) return false;
+        }
+        return true;
+    }
+
+    bool flush() {
+        if (!fill) return true;
+        if (offset + DELTA_SECTOR > partition->size) return false;
+        if (esp_partition_erase_range(partition, offset, DELTA_SECTOR) != ESP_OK) return false;
+        if (esp_partition_write(partition, offset, sector, fill) != ESP_OK) return false;
+        offset += fill;
+        fill = 0;
+        return true;
+    }
+};
+
+/***************************************************************************************
+** Function name: partitionDigest
+** Description:   SHA-256 of the first len bytes of a partition
+***************************************************************************************/
+static bool partitionDigest(const esp_partition_t *partition, size_t len, uint8_t *buf, uint8_t digest[32]) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    bool ok = true;
+    for (size_t pos = 0; pos < len && ok; pos += DELTA_SECTOR) {
+        size_t n = len - pos < DELTA_SECTOR ? len - pos : DELTA_SECTOR;
+        ok = esp_partition_read(partition, pos, buf, n) == ESP_OK;
+        mbedtls_sha256_update(&sha, buf, n);
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: applyDeltaUpdate
+** Description:   rebuilds the new image into spiffs from ota_0 and the patch, checks
+**                it, copies it over ota_0 and makes it the boot partition
+***************************************************************************************/
+bool applyDeltaUpdate(Stream &patch) {
+    uint8_t header[44];
+    uint8_t control[12];
+    uint8_t digest[32];
+    uint8_t old[256];
+    DeltaWriter out = {};
+    uint8_t *sector = nullptr;
+    size_t oldSize, newSize, oldPos = 0;
+    bool success = false;
+
+    const esp_partition_t *app =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    const esp_partition_t *scratch =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    if (!app || !scratch) {
+        displayRedStripe("No room for delta");
+        return false;
+    }
+
+    if (!readFull(patch, header, sizeof(header)) || memcmp(header, DELTA_MAGIC, 4) != 0) {
+        displayRedStripe("Invalid delta patch");
+        return false;
+    }
+    oldSize = le32(&header[4]);
+    newSize = le32(&header[8]);
+    if (oldSize > app->size || newSize > app->size || newSize > scratch->size) {
+        displayRedStripe("Delta too big");
+        return false;
+    }
+
+    sector = (uint8_t *)malloc(DELTA_SECTOR);
+    if (!sector) {
+        displayRedStripe("Not enough memory");
+        return false;
+    }
+    out.partition = scratch;
+    out.sector = sector;
+    mbedtls_sha256_init(&out.sha);
+    mbedtls_sha256_starts(&out.sha, 0);
+
+    /* Rebuild into the scratch partition */
+    displayRedStripe("Applying delta");
+    prog_handler = 0;
+    progressHandler(0, newSize);
+    while (out.offset + out.fill < newSize) {
+        if (!readFull(patch, control, sizeof(control))) goto Exit;
+        uint32_t add = le32(&control[0]);
+        uint32_t copy = le32(&control[4]);
+        int32_t seek = (int32_t)le32(&control[8]);
+        if (out.offset + out.fill + add + copy > newSize || oldPos + add > oldSize) goto Exit;
+
+        // diff bytes, added to the old image
+        while (add) {
+            uint8_t diff[sizeof(old)];
+            size_t n = add < sizeof(old) ? add : sizeof(old);
+            if (!readFull(patch, diff, n) || esp_partition_read(app, oldPos, old, n) != ESP_OK) goto Exit;
+            for (size_t i = 0; i < n; i++) diff[i] += old[i];
+            if (!out.push(diff, n)) goto Exit;
+            oldPos += n;
+            add -= n;
+        }
+        // extra bytes, new in this version
+        while (copy) {
+            size_t n = copy < sizeof(old) ? copy : sizeof(old);
+            if (!readFull(patch, old, n) || !out.push(old, n)) goto Exit;
+            copy -= n;
+        }
+        if ((int64_t)oldPos + seek < 0 || (int64_t)oldPos + seek > (int64_t)oldSize) goto Exit;
+        oldPos += seek;
+        progressHandler(out.offset + out.fill, newSize);
+    }
+    if (!out.flush()) goto Exit;
+    mbedtls_sha256_finish(&out.sha, digest);
+    if (memcmp(digest, &header[12], 32) != 0) {
+        log_i("Delta: rebuilt image doesn't match, is the installed version the patch base?");
+        goto Exit;
+    }
+    // what is in flash, not only what was sent to it
+    if (!partitionDigest(scratch, newSize, sector, digest) || memcmp(digest, &header[12], 32) != 0) goto Exit;
+
+    /* Copy over ota_0, the old image isn't needed anymore */
+    displayRedStripe("Installing");
+    for (size_t pos = 0; pos < newSize; pos += DELTA_SECTOR) {
+        size_t n = newSize - pos < DELTA_SECTOR ? newSize - pos : DELTA_SECTOR;
+        if (esp_partition_read(scratch, pos, sector, n) != ESP_OK ||
+            esp_partition_erase_range(app, pos, DELTA_SECTOR) != ESP_OK ||
+            esp_partition_write(app, pos, sector, n) != ESP_OK)
+            goto Exit;
+        progressHandler(pos + n, newSize);
+    }
+    if (!partitionDigest(app, newSize, sector, digest) || memcmp(digest, &header[12], 32) != 0) goto Exit;
+    {
+        // the whole image, as the bootloader will check it. ota_0 is started by the
+        // Launcher, the boot partition is only set on the P4 (others have no otadata)
+        esp_image_metadata_t meta;
+        const esp_partition_pos_t pos = {app->address, app->size};
+        success = esp_image_verify(ESP_IMAGE_VERIFY, &pos, &meta) == ESP_OK;
+#if CONFIG_IDF_TARGET_ESP32P4
+        if (success) success = esp_ota_set_boot_partition(app) == ESP_OK;
+#endif
+    }
+
+Exit:
+    mbedtls_sha256_free(&out.sha);
+    // the firmware finds an empty spiffs and formats it, instead of a corrupted one
+    esp_partition_erase_range(scratch, 0, (newSize + DELTA_SECTOR - 1) & ~(DELTA_SECTOR - 1));
+    free(sector);
+    if (!success) displayRedStripe("Delta failed");
+    return success;
+}
@@ -0,0 +1,28 @@
+#ifndef __DELTAUPDATE_H
+#define __DELTAUPDATE_H
+#include <Arduino.h>
+
+// First bytes of an inflated patch made by support_files/make_delta.py
+#define DELTA_MAGIC "LDP1"
+
+/*
+  Delta patches rebuild a new app image from the one installed in ota_0, so a
+  version bump downloads only what changed. A patch (gzip compressed) is:
+
+    "LDP1", old size (u32), new size (u32), SHA-256 of the new image (32 bytes)
+    records until the new size is reached:
+      add (u32), copy (u32), seek (i32)
+      add bytes, each added to the next byte of the old image
+      copy bytes, taken as they are
+      then the old image position moves by seek
+
+  the same control/diff/extra triplets as bsdiff, interleaved so the patch can be
+  applied while it is downloaded. Numbers are little endian.
+
+  The new image is written to the spiffs partition, used as scratch space since
+  ota_0 is being read, and its digest is checked before it is copied over ota_0.
+  The spiffs data of the installed firmware is lost.
+*/
+bool applyDeltaUpdate(Stream &patch);
+
+#endif
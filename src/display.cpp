@@ -1,9 +1,12 @@
 #include "display.h"
+#include "catalogPrefetch.h"
+#include "fwIndex.h"
 #include "mykeyboard.h"
 #include "onlineLauncher.h"
 #include "powerSave.h"
 #include "sd_functions.h"
 #include "settings.h"
+#include "trace.h"
 #include <cstring>
 #include <globals.h>
 
@@ -160,6 +163,8 @@ void TouchFooter2(uint16_t color) {
 ** Description:   Start Display functions and display bootscreen
 ***************************************************************************************/
 void initDisplay(bool doAll) {
+    // the boot screen animation calls it again and again, only the first draw is kept
+    TRACE_SPAN_IF(doAll, "initDisplay");
 #ifndef HEADLESS
     static uint8_t _name = random(0, 3);
     String name = "@Pirata";
@@ -429,6 +434,29 @@ void progressHandler(size_t progress, size_t total) {
     wakeUpScreen();
 }
 
+#if defined(E_PAPER_DISPLAY) && defined(GxEPD2_DISPLAY)
+// Menu page last sent to the panel by drawOptions
+static struct {
+    const Option *options = nullptr;
+    int count = -1;
+    int start = -1;
+    int index = -1;
+    int boxY = -1;
+    int boxH = -1;
+    uint32_t labels = 0;    // hash of the labels of the page
+    uint32_t refreshes = 0; // tft->refreshes() after it was sent
+} epdMenu;
+
+static uint32_t labelsHash(const std::vector<Option> &opt, int start, int count) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = start; i < start + count && i < (int)opt.size(); i++) {
+        for (const char *c = opt[i].label.c_str(); *c; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+        hash = (hash ^ 0xFF) * 16777619u;
+    }
+    return hash;
+}
+#endif
+
 /***************************************************************************************
 ** Function name: drawOptions
 ** Description:   Função para desenhar e mostrar as opçoes de contexto
@@ -698,7 +726,25 @@ Opt_Coord drawOptions(
         }
     }
 
-#ifdef E_PAPER_DISPLAY
+#if defined(E_PAPER_DISPLAY) && defined(GxEPD2_DISPLAY)
+    // the same page still on the panel: only the rows from the old marker to the new one changed
+    uint32_t labels = labelsHash(opt, start, optionCount);
+    if (epdMenu.refreshes == tft->refreshes() && epdMenu.options == opt.data() && epdMenu.count == arraySize &&
+        epdMenu.start == start && epdMenu.boxY == boxY && epdMenu.boxH == contentHeight &&
+        epdMenu.labels == labels && epdMenu.index >= start && epdMenu.index < start + optionCount) {
+        int rowStride = lineHeight + rowSpacing;
+        int firstRow = (epdMenu.index < index ? epdMenu.index : index) - start + (showPageUp ? 1 : 0);
+        int lastRow = (epdMenu.index > index ? epdMenu.index : index) - start + (showPageUp ? 1 : 0);
+        int top = textStartY + firstRow * rowStride;
+        if (epdMenu.index != index)
+            tft->displayPartial(boxX, top, contentWidth, (lastRow - firstRow) * rowStride + lineHeight);
+    } else {
+        tft->display(false);
+    }
+    epdMenu = {opt.data(), arraySize, start, index, boxY, contentHeight, labels, tft->refreshes()};
+    tft->startCallback();
+    vTaskDelay(pdTICKS_TO_MS(200));
+#elif defined(E_PAPER_DISPLAY)
     tft->display(false);
     tft->startCallback();
     vTaskDelay(pdTICKS_TO_MS(200));
@@ -814,7 +860,10 @@ void drawBatteryStatus(uint8_t bat) {
 **  Function: loopOptions
 **  Where you choose among the options in menu
 **********************************************************************/
-int loopOptions(std::vector<Option> &options, bool bright, uint16_t al, uint16_t bg, bool border, int index) {
+int loopOptions(
+    std::vector<Option> &options, bool bright, uint16_t al, uint16_t bg, bool border, int index,
+    std::function<void(int)> onHighlight
+) {
     bool redraw = true;
     bool exit = false;
     log_i("Number of options: %d", options.size());
@@ -843,6 +892,7 @@ int loopOptions(std::vector<Option> &options, bool bright, uint16_t al, uint16_t
                 }
             }
             if (bright) { setBrightness(100 * (numOpt - index) / numOpt, false); }
+            if (onHighlight) onHighlight(index);
             redraw = false;
         }
         if (index >= 0 && index < static_cast<int>(options.size())) {
@@ -972,6 +1022,7 @@ void loopVersions(String _fid) {
         const char *version = Version["version"];
         const char *published_at = Version["published_at"];
         const char *file = Version["file"];
+        const char *sha256 = Version["sha256"] | ""; // app image digest, when the hub provides it
         bool spiffs = Version["s"].as<bool>();
         bool fat = Version["f"].as<bool>();
         bool fat2 = Version["f2"].as<bool>();
@@ -1083,11 +1134,41 @@ void loopVersions(String _fid) {
                          nb,
                          fat,
                          (uint32_t *)FAT_offset,
-                         (uint32_t *)FAT_size
+                         (uint32_t *)FAT_size,
+                         String(sha256)
                      );
                  }}
             };
+            // a patch from the installed version downloads only what changed
+            for (JsonObject delta : Version["delta"].as<JsonArray>()) {
+                if (!isInstalledApp(delta["from"] | "")) continue;
+                String patch = delta["file"] | "";
+                String size = String(delta["size"].as<uint32_t>() / 1024) + "K";
+                options.insert(options.begin(), Option("Delta update (" + size + ")", [=]() {
+                                   installDeltaFirmware(String(fid), patch);
+                               }));
+                break;
+            }
             if (sdcardMounted) {
+                options.push_back({"Install + keep copy", [=]() {
+                                       installFirmware(
+                                           String(fid),
+                                           String(file),
+                                           app_size,
+                                           spiffs,
+                                           spiffs_offset,
+                                           spiffs_size,
+                                           nb,
+                                           fat,
+                                           (uint32_t *)FAT_offset,
+                                           (uint32_t *)FAT_size,
+                                           String(sha256),
+                                           firmwarePath(
+                                               String(file), String(name) + "." + String(version).substring(0, 10),
+                                               dwn_path
+                                           )
+                                       );
+                                   }});
                 options.push_back({"Download->SD", [=]() {
                                        downloadFirmware(
                                            String(fid),
@@ -1139,33 +1220,41 @@ RESTART:
         index = 1;
     }
     options = {};
-    int items = doc["page_size"].as<int>();
-    int page = doc["page"].as<int>();
-    if (total_firmware < (page * items)) {
-        if (page == 1) items = total_firmware;
-        else items = total_firmware - items * (page - 1);
-    }
     options.push_back({"[Refine Search]", [&]() { refine = true; }, ALCOLOR});
 
     if (current_page > 1) {
         // Volta uma página
         options.push_back({"[Previous Page]", [=]() { current_page -= 1; }, ALCOLOR});
     }
-    for (int i = 0; i < items; i++) {
-        bool stared = doc["items"][i]["star"].as<bool>();
-        String txt =
-            doc["items"][i]["name"].as<String>() + " (" + doc["items"][i]["author"].as<String>() + ")";
-        options.push_back({txt, [=]() { currentIndex = i; }, stared ? FGCOLOR - 0x1111 : FGCOLOR});
+    for (int i = 0; i < (int)catalog.size(); i++) {
+        String txt = catalog[i].name + " (" + catalog[i].author + ")";
+        options.push_back({txt, [=]() { currentIndex = i; }, catalog[i].star ? FGCOLOR - 0x1111 : FGCOLOR});
     };
-    if (total_firmware > doc["page_size"].as<int>() * current_page) {
+    if (total_firmware > catalog_page_size * current_page) {
         // Avança uma pagina
         options.push_back({"[Next Page]", [=]() { current_page += 1; }, ALCOLOR});
     }
     options.push_back({"[Main Menu]", [=]() { returnToMenu = true; }, ALCOLOR});
 
+    // while the list is shown, fetch what is likely to be asked next
+    auto prefetch = [&](int idx) {
+        std::vector<String> paths;
+        int item = idx - (current_page > 1 ? 2 : 1); // after [Refine Search] and [Previous Page]
+        if (item >= 0 && item < (int)catalog.size()) paths.push_back(versionsPath(catalog[item].fid));
+        else if (current_page > 1 && idx == 1) paths.push_back(catalogPath(current_page - 1, order_by, star, query));
+        if (total_firmware > catalog_page_size * current_page)
+            paths.push_back(catalogPath(current_page + 1, order_by, star, query));
+        prefetchRequest(paths);
+    };
+
+    int shownPage = current_page;
     tft->fillScreen(BGCOLOR);
-    index = loopOptions(options, false, FGCOLOR, BGCOLOR, false, index);
-    if (currentIndex >= 0) loopVersions(doc["items"][currentIndex]["fid"].as<String>());
+    index = loopOptions(options, false, FGCOLOR, BGCOLOR, false, index, prefetch);
+    // the request in flight may be the one just chosen, it is left to finish
+    if (currentIndex >= 0) prefetchStop(versionsPath(catalog[currentIndex].fid));
+    else if (current_page != shownPage) prefetchStop(catalogPath(current_page, order_by, star, query));
+    else prefetchStop();
+    if (currentIndex >= 0) loopVersions(catalog[currentIndex].fid);
     if (refine) {
         refine = false;
         std::vector<Option> opt = {
@@ -1200,7 +1289,8 @@ RESTART:
         loopOptions(opt);
     }
     if (!returnToMenu && index >= 0) goto RESTART;
-    doc.clear();
+    catalog.clear();
+    catalog.shrink_to_fit();
 }
 
 /*********************************************************************
@@ -0,0 +1,370 @@
+#include "fwIndex.h"
+#include "gzStream.h"
+#include "sd_functions.h"
+#include <esp_partition.h>
+#include <globals.h>
+#include <mbedtls/sha256.h>
+#include <set>
+
+// ESP app image header (esp_image_header_t) and segment header sizes
+#define IMAGE_HEADER_SIZE 24
+#define IMAGE_SEGMENT_HEADER_SIZE 8
+#define IMAGE_MAX_SEGMENTS 16
+#define IMAGE_HASH_APPENDED 23 // offset of hash_appended in the header
+
+static JsonDocument idx;         // index of idxFolder
+static String idxFolder = "";
+static bool idxLoaded = false;
+static bool idxDirty = false;
+static bool idxListing = false;  // readFs pass running, entries not seen are pruned at the end
+static std::set<String> idxSeen;
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static String toHex(const uint8_t *data, size_t len) {
+    const char hex[] = "0123456789abcdef";
+    String out;
+    out.reserve(len * 2);
+    for (size_t i = 0; i < len; i++) {
+        out += hex[data[i] >> 4];
+        out += hex[data[i] & 0x0F];
+    }
+    return out;
+}
+
+static String folderOf(const String &path) {
+    String folder = path.substring(0, path.lastIndexOf('/'));
+    return folder == "" ? "/" : folder;
+}
+
+static String indexPath(const String &folder) {
+    return folder.endsWith("/") ? folder + FW_INDEX_FILE : folder + "/" + FW_INDEX_FILE;
+}
+
+/***************************************************************************************
+** Function name: parseFirmwareLayout
+** Description:   reads the partition table of a merged image, if it has one.
+**                Sizes are the ones in the table, the caller limits them to the
+**                image and to this device partitions.
+***************************************************************************************/
+bool parseFirmwareLayout(Stream &source, SeekFunction seekTo, FirmwareLayout &layout) {
+    uint8_t entry[32];
+    layout.hasTable = false;
+    // images smaller than 0x8000 are plain app binaries
+    if (!seekTo(0x8000) || source.readBytes(entry, sizeof(entry)) != sizeof(entry)) return true;
+    if (entry[0] != 0xAA || entry[1] != 0x50 || entry[2] != 0x01) return true;
+
+    layout.hasTable = true;
+    for (int i = 0; i < 0xC00 / 32; i++) {
+        if (i && source.readBytes(entry, sizeof(entry)) != sizeof(entry)) break;
+        if (entry[0] != 0xAA || entry[1] != 0x50) break; // end of the table or MD5 entry
+
+        // https://docs.espressif.com/projects/esp-idf/en/stable/esp32/api-guides/partition-tables.html
+        uint32_t offset = le32(&entry[4]);
+        uint32_t size = le32(&entry[8]);
+        if (entry[2] == 0x00 && offset == FW_APP_OFFSET) layout.appSize = size;
+        if (entry[3] == 0x82) {
+            layout.spiffsOffset = offset;
+            layout.spiffsSize = size;
+        }
+        if (entry[3] == 0x81 && entry[0x0C] == 's') {
+            layout.fatSysOffset = offset;
+            layout.fatSysSize = size;
+        }
+        if (entry[3] == 0x81 && entry[0x0C] == 'v') {
+            layout.fatVfsOffset = offset;
+            layout.fatVfsSize = size;
+        }
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: appImageDigest
+** Description:   SHA-256 of the app image at offset, the same value that
+**                esp_partition_get_sha256() gives for it once installed: the appended
+**                digest when the image has one, otherwise the hash of the whole image
+**                (only computed when compute is true, it means reading all of it).
+***************************************************************************************/
+bool appImageDigest(Stream &source, SeekFunction seekTo, uint32_t offset, bool compute, uint8_t digest[32]) {
+    uint8_t header[IMAGE_HEADER_SIZE];
+    uint8_t segment[IMAGE_SEGMENT_HEADER_SIZE];
+    uint32_t length = IMAGE_HEADER_SIZE;
+
+    if (!seekTo(offset) || source.readBytes(header, sizeof(header)) != sizeof(header)) return false;
+    if (header[0] != 0xE9 || header[1] > IMAGE_MAX_SEGMENTS) return false;
+    bool hashAppended = header[IMAGE_HASH_APPENDED] == 1;
+
+    // walk the segments to find where the image ends
+    for (int i = 0; i < header[1]; i++) {
+        if (!seekTo(offset + length) || source.readBytes(segment, sizeof(segment)) != sizeof(segment))
+            return false;
+        length += IMAGE_SEGMENT_HEADER_SIZE + le32(&segment[4]);
+    }
+    length = (length + 1 + 15) & ~15; // checksum byte, padded to 16
+
+    if (hashAppended) {
+        return seekTo(offset + length) && source.readBytes(digest, 32) == 32;
+    }
+    if (!compute || !seekTo(offset)) return false;
+
+    uint8_t buf[512];
+    uint32_t remaining = length;
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    while (remaining) {
+        size_t n = source.readBytes(buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if (!n) break;
+        mbedtls_sha256_update(&ctx, buf, n);
+        remaining -= n;
+    }
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    return remaining == 0;
+}
+
+bool isFirmwareFile(const String &name) {
+    String lower = name;
+    lower.toLowerCase();
+    return lower.endsWith(".bin") || lower.endsWith(".bin.gz");
+}
+
+/***************************************************************************************
+** Function name: idxSave / idxLoad / idxUnload
+** Description:   keep the index of one folder in memory, written back when changed,
+**                only while a listing or an install needs it
+***************************************************************************************/
+static void idxSave() {
+    if (!idxLoaded || !idxDirty) return;
+    File f = SDM.open(indexPath(idxFolder), FILE_WRITE);
+    if (!f) return;
+    serializeJson(idx, f);
+    f.close();
+    idxDirty = false;
+}
+
+static void idxLoad(const String &folder) {
+    if (idxLoaded && idxFolder == folder) return;
+    idxSave();
+    idx.clear();
+    idxFolder = folder;
+    idxLoaded = true;
+    idxDirty = false;
+    File f = SDM.open(indexPath(folder), FILE_READ);
+    if (f) {
+        if (deserializeJson(idx, f)) idx.clear();
+        f.close();
+    }
+    if (!idx["files"].is<JsonObject>()) idx["files"].to<JsonObject>();
+}
+
+static void idxUnload() {
+    idxSave();
+    idx.clear();
+    idx.shrinkToFit();
+    idxLoaded = false;
+    idxDirty = false;
+}
+
+/***************************************************************************************
+** Function name: probe
+** Description:   parses the image itself, used when the index is missing or stale
+***************************************************************************************/
+static bool probe(File &file, FirmwareLayout &layout) {
+    uint8_t digest[32];
+    layout = FirmwareLayout();
+    layout.compressed = isGzipFile(file);
+    GzStream gz(file, [&]() { return file.seek(0); });
+    Stream *source = &file;
+    SeekFunction seekTo = [&](size_t pos) { return layout.compressed ? gz.seek(pos) : file.seek(pos); };
+
+    if (layout.compressed) {
+        if (!gz.begin()) return false;
+        source = &gz;
+        layout.imageSize = gzipInflatedSize(file);
+    } else layout.imageSize = file.size();
+
+    if (!parseFirmwareLayout(*source, seekTo, layout)) return false;
+    // walking the segments of a .bin.gz inflates the whole app, fwIndexAppDigest
+    // fills the digest in when the image is installed
+    if (layout.compressed) return true;
+    // only the cheap case here, images without appended digest are hashed when needed
+    if (appImageDigest(*source, seekTo, layout.hasTable ? FW_APP_OFFSET : 0, false, digest))
+        layout.sha256 = toHex(digest, sizeof(digest));
+    return true;
+}
+
+static void toJson(JsonObject e, File &file, const FirmwareLayout &l) {
+    e["s"] = (uint32_t)file.size();
+    e["m"] = (uint32_t)file.getLastWrite();
+    e["gz"] = l.compressed;
+    e["t"] = l.hasTable;
+    JsonArray a = e["l"].to<JsonArray>();
+    a.add(l.imageSize);
+    a.add(l.appSize);
+    a.add(l.spiffsOffset);
+    a.add(l.spiffsSize);
+    a.add(l.fatSysOffset);
+    a.add(l.fatSysSize);
+    a.add(l.fatVfsOffset);
+    a.add(l.fatVfsSize);
+    if (l.sha256.length()) e["h"] = l.sha256;
+}
+
+static void fromJson(JsonObject e, FirmwareLayout &l) {
+    JsonArray a = e["l"];
+    l.compressed = e["gz"].as<bool>();
+    l.hasTable = e["t"].as<bool>();
+    l.imageSize = a[0];
+    l.appSize = a[1];
+    l.spiffsOffset = a[2];
+    l.spiffsSize = a[3];
+    l.fatSysOffset = a[4];
+    l.fatSysSize = a[5];
+    l.fatVfsOffset = a[6];
+    l.fatVfsSize = a[7];
+    l.sha256 = e["h"] | "";
+}
+
+/***************************************************************************************
+** Function name: fwIndexGet
+** Description:   layout of an opened image, from the index when size and mtime
+**                still match, probing the file (and updating the index) otherwise
+***************************************************************************************/
+bool fwIndexGet(File &file, FirmwareLayout &layout) {
+    String name = file.name();
+    idxLoad(folderOf(file.path()));
+    if (idxListing) idxSeen.insert(name);
+
+    JsonObject e = idx["files"][name];
+    if (!e.isNull() && e["s"].as<uint32_t>() == file.size() &&
+        e["m"].as<uint32_t>() == (uint32_t)file.getLastWrite()) {
+        fromJson(e, layout);
+        return true;
+    }
+    if (!probe(file, layout)) return false;
+    toJson(idx["files"][name].to<JsonObject>(), file, layout);
+    idxDirty = true;
+    return true;
+}
+
+/***************************************************************************************
+** Function name: fwIndexBeginListing / fwIndexEndListing
+** Description:   wrap a folder listing, entries of files that are gone are dropped
+***************************************************************************************/
+void fwIndexBeginListing(const String &folder) {
+    idxLoad(folder);
+    idxSeen.clear();
+    idxListing = true;
+}
+
+void fwIndexEndListing() {
+    std::vector<String> gone;
+    for (JsonPair kv : idx["files"].as<JsonObject>()) {
+        if (!idxSeen.count(kv.key().c_str())) gone.push_back(kv.key().c_str());
+    }
+    for (const String &name : gone) idx["files"].remove(name);
+    if (gone.size()) idxDirty = true;
+    idxSeen.clear();
+    idxListing = false;
+    idxUnload();
+}
+
+/***************************************************************************************
+** Function name: fwIndexLookup
+** Description:   layout of the image at path
+***************************************************************************************/
+bool fwIndexLookup(const String &path, FirmwareLayout &layout) {
+    File file = SDM.open(path);
+    if (!file) return false;
+    bool ok = fwIndexGet(file, layout);
+    file.close();
+    idxUnload();
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: fwIndexSetSha256
+** Description:   stores the image digest once it was computed
+***************************************************************************************/
+void fwIndexSetSha256(const String &path, const String &sha256) {
+    idxLoad(folderOf(path));
+    JsonObject e = idx["files"][path.substring(path.lastIndexOf('/') + 1)];
+    if (!e.isNull() && e["h"] != sha256) {
+        e["h"] = sha256;
+        idxDirty = true;
+    }
+    idxUnload();
+}
+
+/***************************************************************************************
+** Function name: fwIndexAppDigest
+** Description:   app digest of the image at path, hashing the image (and keeping the
+**                result in the index) when it has no appended digest
+***************************************************************************************/
+String fwIndexAppDigest(const String &path, FirmwareLayout &layout) {
+    uint8_t digest[32];
+    if (layout.sha256.length()) return layout.sha256;
+
+    File file = SDM.open(path);
+    if (!file) return "";
+    GzStream gz(file, [&]() { return file.seek(0); });
+    SeekFunction seekTo = [&](size_t pos) { return layout.compressed ? gz.seek(pos) : file.seek(pos); };
+    if (layout.compressed && (!file.seek(0) || !gz.begin())) {
+        file.close();
+        return "";
+    }
+    Stream *source = layout.compressed ? (Stream *)&gz : (Stream *)&file;
+    if (appImageDigest(*source, seekTo, layout.hasTable ? FW_APP_OFFSET : 0, true, digest))
+        layout.sha256 = toHex(digest, sizeof(digest));
+    gz.end();
+    file.close();
+    if (layout.sha256.length()) fwIndexSetSha256(path, layout.sha256);
+    return layout.sha256;
+}
+
+/***************************************************************************************
+** Function name: isInstalledApp
+** Description:   true when the app in ota_0 has this digest (hex)
+***************************************************************************************/
+bool isInstalledApp(const String &sha256) {
+    uint8_t digest[32];
+    if (sha256.length() != 64) return false;
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    // fails when there is no valid app in it
+    if (!partition || esp_partition_get_sha256(partition, digest) != ESP_OK) return false;
+    return sha256.equalsIgnoreCase(toHex(digest, sizeof(digest)));
+}
+
+static bool hasSpiffs(const FirmwareLayout &layout) {
+    return layout.hasTable && layout.spiffsSize && layout.imageSize > layout.spiffsOffset;
+}
+
+static bool hasFat(const FirmwareLayout &layout) {
+    return layout.hasTable && ((layout.fatSysSize && layout.imageSize > layout.fatSysOffset) ||
+                               (layout.fatVfsSize && layout.imageSize > layout.fatVfsOffset));
+}
+
+/***************************************************************************************
+** Function name: fwIndexHasData
+** Description:   true when the image also holds SPIFFS or FAT partitions
+***************************************************************************************/
+bool fwIndexHasData(const FirmwareLayout &layout) { return hasSpiffs(layout) || hasFat(layout); }
+
+/***************************************************************************************
+** Function name: fwIndexDescribe
+** Description:   short text shown next to the file name in the SD browser
+***************************************************************************************/
+String fwIndexDescribe(const FirmwareLayout &layout) {
+    String type = layout.hasTable ? "merged" : "app";
+    if (hasSpiffs(layout)) type += "+spiffs";
+    if (hasFat(layout)) type += "+fat";
+    if (layout.compressed) type += " gz";
+    String size = layout.imageSize >= 1024 * 1024 ? String(layout.imageSize / 1048576.0, 1) + "M"
+                                                  : String(layout.imageSize / 1024) + "K";
+    return "(" + type + " " + size + ")";
+}
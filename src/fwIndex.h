@@ -0,0 +1,53 @@
+#ifndef __FWINDEX_H
+#define __FWINDEX_H
+#include <Arduino.h>
+#include <FS.h>
+#include <functional>
+
+// Hidden file, one per folder, caching what was learned about each image in it
+#define FW_INDEX_FILE ".fwindex.json"
+
+// Offset of the app in a merged image (bootloader + partition table + app)
+#define FW_APP_OFFSET 0x10000
+
+struct FirmwareLayout {
+    bool compressed = false; // .bin.gz, offsets below refer to the inflated image
+    bool hasTable = false;   // merged image, with a partition table at 0x8000
+    uint32_t imageSize = 0;  // inflated size
+    uint32_t appSize = 0;    // app partition at 0x10000, from the table
+    uint32_t spiffsOffset = 0;
+    uint32_t spiffsSize = 0;
+    uint32_t fatSysOffset = 0;
+    uint32_t fatSysSize = 0;
+    uint32_t fatVfsOffset = 0;
+    uint32_t fatVfsSize = 0;
+    String sha256; // app image digest (hex), as esp_partition_get_sha256 reports it once installed
+};
+
+typedef std::function<bool(size_t)> SeekFunction;
+
+bool parseFirmwareLayout(Stream &source, SeekFunction seekTo, FirmwareLayout &layout);
+
+bool appImageDigest(Stream &source, SeekFunction seekTo, uint32_t offset, bool compute, uint8_t digest[32]);
+
+bool isFirmwareFile(const String &name);
+
+void fwIndexBeginListing(const String &folder);
+
+bool fwIndexGet(File &file, FirmwareLayout &layout);
+
+void fwIndexEndListing();
+
+bool fwIndexLookup(const String &path, FirmwareLayout &layout);
+
+void fwIndexSetSha256(const String &path, const String &sha256);
+
+String fwIndexAppDigest(const String &path, FirmwareLayout &layout);
+
+bool isInstalledApp(const String &sha256);
+
+bool fwIndexHasData(const FirmwareLayout &layout);
+
+String fwIndexDescribe(const FirmwareLayout &layout);
+
+#endif
@@ -0,0 +1,236 @@
+#include "fwSlots.h"
+#include "display.h"
+#include "fwIndex.h"
+#include "partitionBackup.h"
+#include "partitioner.h"
+#include "sd_functions.h"
+#include <algorithm>
+#include <esp_app_desc.h>
+#include <globals.h>
+#include <nvs_handle.hpp>
+
+#define SLOT_ALIGN 0x10000 // slots start on erase blocks
+
+static String slotKey(int index) { return "s" + String(index); }
+
+static String toHex(const uint8_t *data, size_t len) {
+    String hex;
+    char byte[3];
+    for (size_t i = 0; i < len; i++) {
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
+/***************************************************************************************
+** Function name: slotArea
+** Description:   range of the Launcher partition the slots can use
+***************************************************************************************/
+static const esp_partition_t *slotArea(size_t &start, size_t &end) {
+    const esp_partition_t *part = esp_ota_get_running_partition();
+    if (!part || part->subtype != TARGET_PARTITION) return nullptr; // not in place yet, see partitionCrawler
+    size_t image = appImageLength(part);
+    if (!image) return nullptr;
+    start = ((image + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1)) + FW_SLOT_HEADROOM;
+    end = part->size;
+    return start < end ? part : nullptr;
+}
+
+bool slotsAvailable() {
+    size_t start, end;
+    return slotArea(start, end) != nullptr;
+}
+
+/***************************************************************************************
+** Function name: slotList
+** Description:   slots stored in NVS, by offset
+***************************************************************************************/
+std::vector<FwSlot> slotList() {
+    std::vector<FwSlot> slots;
+    esp_err_t err;
+    auto nvsHandle = nvs::open_nvs_handle("l_slots", NVS_READONLY, &err);
+    if (err != ESP_OK) return slots;
+    for (int i = 0; i < FW_SLOT_MAX; i++) {
+        FwSlot slot;
+        if (nvsHandle->get_blob(slotKey(i).c_str(), &slot, sizeof(slot)) == ESP_OK) slots.push_back(slot);
+    }
+    std::sort(slots.begin(), slots.end(), [](const FwSlot &a, const FwSlot &b) { return a.offset < b.offset; });
+    return slots;
+}
+
+/***************************************************************************************
+** Function name: slotStore
+** Description:   writes or erases (slot null) the NVS record of the slot at offset
+***************************************************************************************/
+static bool slotStore(uint32_t offset, const FwSlot *slot) {
+    esp_err_t err;
+    auto nvsHandle = nvs::open_nvs_handle("l_slots", NVS_READWRITE, &err);
+    if (err != ESP_OK) return false;
+    int freeIndex = -1;
+    for (int i = 0; i < FW_SLOT_MAX; i++) {
+        FwSlot stored;
+        if (nvsHandle->get_blob(slotKey(i).c_str(), &stored, sizeof(stored)) != ESP_OK) {
+            if (freeIndex < 0) freeIndex = i;
+            continue;
+        }
+        if (stored.offset != offset) continue;
+        if (slot) err = nvsHandle->set_blob(slotKey(i).c_str(), slot, sizeof(*slot));
+        else err = nvsHandle->erase_item(slotKey(i).c_str());
+        return err == ESP_OK && nvsHandle->commit() == ESP_OK;
+    }
+    if (!slot || freeIndex < 0) return false;
+    err = nvsHandle->set_blob(slotKey(freeIndex).c_str(), slot, sizeof(*slot));
+    return err == ESP_OK && nvsHandle->commit() == ESP_OK;
+}
+
+/***************************************************************************************
+** Function name: slotSaveInstalled
+** Description:   copies the app of ota_0 to the first gap of the slot area it fits
+***************************************************************************************/
+bool slotSaveInstalled() {
+    size_t start, end;
+    const esp_partition_t *area = slotArea(start, end);
+    const esp_partition_t *app =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    size_t length = app ? appImageLength(app) : 0;
+    uint8_t digest[32];
+    esp_app_desc_t desc;
+    FwSlot slot = {};
+
+    if (!area || !length) {
+        displayRedStripe(area ? "No app installed" : "No room for slots");
+        delay(2000);
+        return false;
+    }
+    if (esp_partition_get_sha256(app, digest) != ESP_OK) return false;
+    String sha256 = toHex(digest, sizeof(digest));
+
+    std::vector<FwSlot> slots = slotList();
+    for (const FwSlot &s : slots) {
+        if (sha256 == s.sha256) {
+            displayRedStripe("Already in a slot");
+            delay(2000);
+            return false;
+        }
+    }
+    if (slots.size() >= FW_SLOT_MAX) {
+        displayRedStripe("All slots in use");
+        delay(2000);
+        return false;
+    }
+    // first gap it fits in
+    size_t offset = start;
+    for (const FwSlot &s : slots) {
+        if (s.offset >= offset + length) break;
+        offset = std::max(offset, (size_t)((s.offset + s.length + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1)));
+    }
+    if (offset + length > end) {
+        displayRedStripe("Not enough room");
+        delay(2000);
+        return false;
+    }
+
+    String name = "App";
+    if (esp_ota_get_partition_description(app, &desc) == ESP_OK)
+        name = String(desc.project_name) + " " + String(desc.version);
+    strncpy(slot.name, name.c_str(), sizeof(slot.name) - 1);
+    strncpy(slot.sha256, sha256.c_str(), sizeof(slot.sha256) - 1);
+    slot.offset = offset;
+    slot.length = length;
+
+    displayRedStripe("Saving to slot");
+    if (!mappedDigest(app, 0, length, slot.digest) || copy_region(app, 0, area, offset, length) != ESP_OK ||
+        !mappedDigest(area, offset, length, digest) || memcmp(digest, slot.digest, sizeof(digest)) != 0 ||
+        !slotStore(offset, &slot)) {
+        displayRedStripe("Slot save failed");
+        delay(2000);
+        return false;
+    }
+    log_i("Slot: %s at 0x%x, %u bytes", slot.name, offset, length);
+    return true;
+}
+
+/***************************************************************************************
+** Function name: slotLaunch
+** Description:   copies the slot over ota_0, checks it, and restarts into it
+***************************************************************************************/
+bool slotLaunch(const FwSlot &slot) {
+    size_t start, end;
+    uint8_t digest[32];
+    const esp_partition_t *area = slotArea(start, end);
+    const esp_partition_t *app =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    if (!area || !app || slot.offset < start || slot.offset + slot.length > end || slot.length > app->size)
+        return false;
+
+    // already in ota_0, nothing to copy
+    if (!isInstalledApp(slot.sha256)) {
+        displayRedStripe("Checking slot");
+        if (!mappedDigest(area, slot.offset, slot.length, digest) ||
+            memcmp(digest, slot.digest, sizeof(digest)) != 0) {
+            // a bigger Launcher update overwrote it
+            slotStore(slot.offset, nullptr);
+            displayRedStripe("Slot is damaged");
+            delay(2000);
+            return false;
+        }
+        displayRedStripe("Launching slot");
+        if (copy_region(area, slot.offset, app, 0, slot.length) != ESP_OK ||
+            !mappedDigest(app, 0, slot.length, digest) || memcmp(digest, slot.digest, sizeof(digest)) != 0) {
+            displayRedStripe("Slot copy failed");
+            delay(2000);
+            return false;
+        }
+        clearCoredump();
+    }
+    FREE_TFT
+#if CONFIG_IDF_TARGET_ESP32P4
+    esp_ota_set_boot_partition(app);
+    ESP.deepSleep(100);
+#endif
+    ESP.restart();
+    return true;
+}
+
+bool slotRemove(const FwSlot &slot) { return slotStore(slot.offset, nullptr); }
+
+/***************************************************************************************
+** Function name: slotsMenu
+** Description:   lists the slots, to launch or remove them, and saves the installed app
+***************************************************************************************/
+void slotsMenu() {
+    if (!slotsAvailable()) {
+        displayRedStripe("No room for slots");
+        delay(2000);
+        return;
+    }
+    while (!returnToMenu) {
+        std::vector<FwSlot> slots = slotList();
+        int chosen = -1;
+        bool save = false;
+        options = {};
+        for (size_t i = 0; i < slots.size(); i++) {
+            options.push_back({String(slots[i].name), [&chosen, i]() { chosen = i; }});
+        }
+        options.push_back({"Keep installed app", [&]() { save = true; }});
+        options.push_back({"Back", [=]() {}});
+        loopOptions(options);
+        if (save) {
+            slotSaveInstalled();
+            continue;
+        }
+        if (chosen < 0) break;
+
+        int action = 0;
+        options = {
+            {"Launch", [&]() { action = 1; }},
+            {"Remove", [&]() { action = 2; }},
+            {"Back",   [=]() {}             },
+        };
+        loopOptions(options);
+        if (action == 1) slotLaunch(slots[chosen]);
+        if (action == 2) slotRemove(slots[chosen]);
+    }
+    options.clear();
+}
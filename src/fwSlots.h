@@ -0,0 +1,44 @@
+#ifndef __FWSLOTS_H
+#define __FWSLOTS_H
+#include <Arduino.h>
+#include <vector>
+
+// Firmwares kept in flash at the same time
+#ifndef FW_SLOT_MAX
+#define FW_SLOT_MAX 4
+#endif
+
+// Room left after the Launcher image for its next versions, slots start after it
+#ifndef FW_SLOT_HEADROOM
+#define FW_SLOT_HEADROOM 0x80000
+#endif
+
+struct FwSlot {
+    char name[32];
+    char sha256[65];    // app image digest (hex), as esp_partition_get_sha256 reports it
+    uint8_t digest[32]; // SHA-256 of the stored bytes
+    uint32_t offset;    // in the Launcher partition
+    uint32_t length;
+};
+
+/*
+  Slots keep copies of installed apps in the unused end of the partition the
+  Launcher runs from (test, or factory on the P4), described in the "l_slots" NVS
+  namespace. The bootloader starts ota_0 only, so launching a slot copies it
+  flash to flash into ota_0, which takes a few seconds instead of a full install.
+*/
+bool slotsAvailable();
+
+std::vector<FwSlot> slotList();
+
+// Copies the app installed in ota_0 to a free slot
+bool slotSaveInstalled();
+
+// Puts the slot in ota_0 and restarts into it
+bool slotLaunch(const FwSlot &slot);
+
+bool slotRemove(const FwSlot &slot);
+
+void slotsMenu();
+
+#endif
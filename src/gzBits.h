@@ -0,0 +1,24 @@
+#ifndef __GZBITS_H
+#define __GZBITS_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Bytes the inflater read ahead of the end of the deflate data, still sitting in its
+  bit buffer (LSB first). The numBits & 7 lowest bits are the padding of the last
+  deflate byte, the whole bytes after them are the start of the gzip trailer.
+  No Arduino dependency, support_files/gz_trailer_check.cpp builds it on the host.
+*/
+static inline size_t gzBitBufferBytes(uint64_t bitBuf, uint32_t numBits, uint8_t *out, size_t len) {
+    size_t n = 0;
+    bitBuf >>= numBits & 7;
+    numBits &= ~7u;
+    while (numBits && n < len) {
+        out[n++] = bitBuf & 0xFF;
+        bitBuf >>= 8;
+        numBits -= 8;
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,369 @@
+#include "gzStream.h"
+#include "gzBits.h"
+#include <esp_rom_crc.h>
+#if __has_include("miniz.h")
+#include "miniz.h"
+#else
+#include "rom/miniz.h"
+#endif
+
+// gzip header flags (RFC 1952)
+#define GZ_FHCRC 0x02
+#define GZ_FEXTRA 0x04
+#define GZ_FNAME 0x08
+#define GZ_FCOMMENT 0x10
+
+// header parsing steps, the fixed part has 10 bytes
+enum { HDR_FIXED, HDR_XLEN, HDR_EXTRA, HDR_NAME, HDR_COMMENT, HDR_HCRC };
+
+GzInflater::GzInflater() : _state(GZ_FAILED), _decomp(nullptr), _dict(nullptr) {}
+
+GzInflater::~GzInflater() { end(); }
+
+/***************************************************************************************
+** Function name: begin
+** Description:   allocates the decompressor and its dictionary
+***************************************************************************************/
+bool GzInflater::begin() {
+    end();
+    _decomp = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    _dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (!_decomp || !_dict) {
+        log_e("GzInflater: not enough memory");
+        end();
+        return false;
+    }
+    tinfl_init(_decomp);
+    _state = GZ_HEADER;
+    _dictOfs = 0;
+    _hdrFlags = 0;
+    _hdrStep = HDR_FIXED;
+    _hdrCount = 0;
+    _trailerLen = 0;
+    _crc = 0;
+    _totalOut = 0;
+    return true;
+}
+
+void GzInflater::end() {
+    if (_decomp) free(_decomp);
+    if (_dict) free(_dict);
+    _decomp = nullptr;
+    _dict = nullptr;
+    if (_state != GZ_DONE) _state = GZ_FAILED;
+}
+
+/***************************************************************************************
+** Function name: _header
+** Description:   consumes the gzip member header, returns true when it is complete
+***************************************************************************************/
+bool GzInflater::_header(const uint8_t *&in, size_t &inLen) {
+    for (;;) {
+        // step over the optional fields this member doesn't have (or that are already read)
+        if (_hdrStep == HDR_XLEN && !(_hdrFlags & GZ_FEXTRA)) _hdrStep = HDR_NAME;
+        if (_hdrStep == HDR_NAME && !(_hdrFlags & GZ_FNAME)) _hdrStep = HDR_COMMENT;
+        if (_hdrStep == HDR_COMMENT && !(_hdrFlags & GZ_FCOMMENT)) _hdrStep = HDR_HCRC;
+        if (_hdrStep == HDR_HCRC && !(_hdrFlags & GZ_FHCRC)) {
+            _state = GZ_BODY;
+            return true;
+        }
+        if (!inLen) return false;
+        uint8_t c = *in++;
+        inLen--;
+        switch (_hdrStep) {
+            case HDR_FIXED:
+                // ID1 ID2 CM FLG MTIME(4) XFL OS
+                if ((_hdrCount == 0 && c != 0x1F) || (_hdrCount == 1 && c != 0x8B) ||
+                    (_hdrCount == 2 && c != 8)) {
+                    _state = GZ_FAILED;
+                    return false;
+                }
+                if (_hdrCount == 3) _hdrFlags = c;
+                if (++_hdrCount == 10) {
+                    _hdrCount = 0;
+                    _hdrStep = HDR_XLEN;
+                }
+                break;
+            case HDR_XLEN:
+                if (_hdrCount++ == 0) {
+                    _trailer[0] = c;
+                    break;
+                }
+                _hdrCount = _trailer[0] | (c << 8);
+                _hdrStep = HDR_EXTRA;
+                if (_hdrCount == 0) {
+                    _hdrFlags &= ~GZ_FEXTRA;
+                    _hdrStep = HDR_NAME;
+                }
+                break;
+            case HDR_EXTRA:
+                if (--_hdrCount == 0) {
+                    _hdrFlags &= ~GZ_FEXTRA;
+                    _hdrStep = HDR_NAME;
+                }
+                break;
+            case HDR_NAME:
+                if (c == 0) _hdrFlags &= ~GZ_FNAME;
+                break;
+            case HDR_COMMENT:
+                if (c == 0) _hdrFlags &= ~GZ_FCOMMENT;
+                break;
+            case HDR_HCRC:
+                if (++_hdrCount == 2) _hdrFlags &= ~GZ_FHCRC;
+                break;
+        }
+    }
+}
+
+/***************************************************************************************
+** Function name: step
+** Description:   runs the decoder once over the available input
+***************************************************************************************/
+size_t GzInflater::step(const uint8_t *&in, size_t &inLen, uint8_t **out) {
+    if (_state == GZ_HEADER && !_header(in, inLen)) return 0;
+
+    if (_state == GZ_BODY) {
+        size_t inBytes = inLen;
+        size_t outBytes = TINFL_LZ_DICT_SIZE - _dictOfs;
+        tinfl_status status = tinfl_decompress(
+            _decomp, in, &inBytes, _dict, _dict + _dictOfs, &outBytes, TINFL_FLAG_HAS_MORE_INPUT
+        );
+        in += inBytes;
+        inLen -= inBytes;
+        if (status < TINFL_STATUS_DONE) {
+            log_e("GzInflater: corrupted data (%d)", status);
+            _state = GZ_FAILED;
+            return 0;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            _state = GZ_TRAILER;
+            // the decoder reads ahead, the first trailer bytes may be sitting in its bit buffer
+            _trailerLen += gzBitBufferBytes(
+                _decomp->m_bit_buf, _decomp->m_num_bits, _trailer + _trailerLen, sizeof(_trailer) - _trailerLen
+            );
+        }
+        if (outBytes) {
+            *out = _dict + _dictOfs;
+            _crc = esp_rom_crc32_le(_crc, *out, outBytes);
+            _totalOut += outBytes;
+            _dictOfs = (_dictOfs + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        return outBytes;
+    }
+
+    if (_state == GZ_TRAILER) {
+        // CRC32 and ISIZE, little endian
+        while (inLen && _trailerLen < sizeof(_trailer)) {
+            _trailer[_trailerLen++] = *in++;
+            inLen--;
+        }
+        if (_trailerLen < sizeof(_trailer)) return 0;
+        uint32_t crc = _trailer[0] | (_trailer[1] << 8) | (_trailer[2] << 16) | ((uint32_t)_trailer[3] << 24);
+        uint32_t isize = _trailer[4] | (_trailer[5] << 8) | (_trailer[6] << 16) | ((uint32_t)_trailer[7] << 24);
+        if (crc != _crc || isize != (uint32_t)_totalOut) {
+            log_e("GzInflater: CRC mismatch %08x/%08x, size %u/%u", crc, _crc, isize, _totalOut);
+            _state = GZ_FAILED;
+            return 0;
+        }
+        _state = GZ_DONE;
+    }
+    return 0;
+}
+
+/***************************************************************************************
+** Function name: write
+** Description:   push interface, inflates a chunk and hands the output to sink
+***************************************************************************************/
+bool GzInflater::write(const uint8_t *data, size_t len, const Sink &sink) {
+    for (;;) {
+        uint8_t *out;
+        State before = _state;
+        size_t consumed = len;
+        size_t n = step(data, len, &out);
+        if (n && !sink(out, n)) {
+            _state = GZ_FAILED;
+            return false;
+        }
+        if (_state == GZ_FAILED) return false;
+        if (_state == GZ_DONE) return true; // anything after the member is ignored
+        // nothing moved, the decoder is waiting for the next chunk
+        if (!n && consumed == len && before == _state) return true;
+    }
+}
+
+GzStream::GzStream(Stream &source, std::function<bool()> rewind)
+    : _source(source), _rewind(rewind), _input(nullptr), _inPtr(nullptr), _inLen(0), _window(nullptr),
+      _winLen(0), _pos(0) {}
+
+GzStream::~GzStream() { end(); }
+
+/***************************************************************************************
+** Function name: begin
+** Description:   allocates the buffers, must succeed before reading
+***************************************************************************************/
+bool GzStream::begin() {
+    end();
+    _input = (uint8_t *)malloc(GZ_INPUT_SIZE);
+    if (!_input || !_inflater.begin()) {
+        end();
+        return false;
+    }
+    _inPtr = _input;
+    _inLen = 0;
+    _winLen = 0;
+    _pos = 0;
+    return true;
+}
+
+void GzStream::end() {
+    _inflater.end();
+    if (_input) free(_input);
+    _input = nullptr;
+    _inLen = 0;
+    _winLen = 0;
+}
+
+/***************************************************************************************
+** Function name: _fill
+** Description:   inflates until there is output to be read, false at the end
+***************************************************************************************/
+bool GzStream::_fill() {
+    if (!_input) return false;
+    while (!_winLen) {
+        if (_inflater.finished() || _inflater.failed()) return false;
+        if (!_inLen) {
+            _inLen = _source.readBytes((char *)_input, GZ_INPUT_SIZE);
+            _inPtr = _input;
+            if (!_inLen) return false;
+        }
+        _winLen = _inflater.step(_inPtr, _inLen, &_window);
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: seek
+** Description:   moves to a position of the inflated data, skipping what is between
+***************************************************************************************/
+bool GzStream::seek(size_t pos) {
+    if (pos < _pos) {
+        if (!_rewind || !_rewind() || !begin()) return false;
+    }
+    while (_pos < pos) {
+        if (!_fill()) return false;
+        size_t n = pos - _pos < _winLen ? pos - _pos : _winLen;
+        _window += n;
+        _winLen -= n;
+        _pos += n;
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: finished
+** Description:   drains the stream up to the gzip trailer, readers that stop at the
+**                last byte they need leave it unchecked otherwise
+***************************************************************************************/
+bool GzStream::finished() {
+    while (_fill()) {
+        _pos += _winLen;
+        _winLen = 0;
+    }
+    return _inflater.finished();
+}
+
+int GzStream::available() {
+    if (!_winLen) _fill();
+    return _winLen;
+}
+
+int GzStream::read() {
+    if (!_fill()) return -1;
+    uint8_t c = *_window++;
+    _winLen--;
+    _pos++;
+    return c;
+}
+
+int GzStream::peek() {
+    if (!_fill()) return -1;
+    return *_window;
+}
+
+size_t GzStream::readBytes(char *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length && _fill()) {
+        size_t n = length - done < _winLen ? length - done : _winLen;
+        memcpy(buffer + done, _window, n);
+        _window += n;
+        _winLen -= n;
+        _pos += n;
+        done += n;
+    }
+    return done;
+}
+
+/***************************************************************************************
+** Function name: seek
+** Description:   skips the source up to pos, the bytes between are dropped
+***************************************************************************************/
+bool ForwardStream::seek(size_t pos) {
+    char skip[256];
+    if (pos < _pos) return false;
+    while (_pos < pos) {
+        size_t want = pos - _pos < sizeof(skip) ? pos - _pos : sizeof(skip);
+        size_t n = _source.readBytes(skip, want);
+        if (!n) return false;
+        _pos += n;
+    }
+    return true;
+}
+
+int ForwardStream::read() {
+    int c = _source.read();
+    if (c >= 0) _pos++;
+    return c;
+}
+
+size_t ForwardStream::readBytes(char *buffer, size_t length) {
+    size_t n = _source.readBytes(buffer, length);
+    _pos += n;
+    return n;
+}
+
+int TeeStream::read() {
+    int c = _source.read();
+    if (c >= 0 && !_failed && _copy.write((uint8_t)c) != 1) _failed = true;
+    return c;
+}
+
+size_t TeeStream::readBytes(char *buffer, size_t length) {
+    size_t n = _source.readBytes(buffer, length);
+    if (n && !_failed && _copy.write((const uint8_t *)buffer, n) != n) _failed = true;
+    return n;
+}
+
+/***************************************************************************************
+** Function name: isGzipFile
+** Description:   checks the gzip magic, keeps the file position at 0
+***************************************************************************************/
+bool isGzipFile(File &file) {
+    uint8_t magic[2] = {0};
+    if (!file.seek(0)) return false;
+    size_t n = file.read(magic, 2);
+    file.seek(0);
+    return GzInflater::isGzip(magic, n);
+}
+
+/***************************************************************************************
+** Function name: gzipInflatedSize
+** Description:   reads the inflated size from the gzip trailer (ISIZE)
+***************************************************************************************/
+size_t gzipInflatedSize(File &file) {
+    uint8_t isize[4] = {0};
+    size_t pos = file.position();
+    if (file.size() < 18 || !file.seek(file.size() - 4)) return 0;
+    file.read(isize, 4);
+    file.seek(pos);
+    return isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint32_t)isize[3] << 24);
+}
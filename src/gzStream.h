@@ -0,0 +1,151 @@
+#ifndef __GZSTREAM_H
+#define __GZSTREAM_H
+#include <Arduino.h>
+#include <FS.h>
+#include <functional>
+
+// Compressed input is read from the source in chunks of this size
+#ifndef GZ_INPUT_SIZE
+#define GZ_INPUT_SIZE 1024
+#endif
+
+struct tinfl_decompressor_tag;
+
+/*
+  Streaming gzip (deflate) decoder built on the ROM inflate, the window is the
+  32 KB deflate dictionary, allocated only while the inflater is running.
+*/
+class GzInflater {
+public:
+    typedef std::function<bool(uint8_t *data, size_t len)> Sink;
+
+    GzInflater();
+    ~GzInflater();
+
+    bool begin();
+    void end();
+
+    // Decompresses from in, advancing it, and points out to the bytes produced.
+    // Returns how many bytes are at out, valid until the next call.
+    size_t step(const uint8_t *&in, size_t &inLen, uint8_t **out);
+
+    // Push interface: decompresses a chunk of data and hands the output to sink
+    bool write(const uint8_t *data, size_t len, const Sink &sink);
+
+    bool finished() { return _state == GZ_DONE; }
+    bool failed() { return _state == GZ_FAILED; }
+    size_t totalOut() { return _totalOut; }
+
+    static bool isGzip(const uint8_t *data, size_t len) {
+        return len >= 2 && data[0] == 0x1F && data[1] == 0x8B;
+    }
+
+private:
+    enum State { GZ_HEADER, GZ_BODY, GZ_TRAILER, GZ_DONE, GZ_FAILED };
+    bool _header(const uint8_t *&in, size_t &inLen);
+
+    State _state;
+    struct tinfl_decompressor_tag *_decomp;
+    uint8_t *_dict;
+    size_t _dictOfs;
+    uint8_t _hdrFlags;
+    uint8_t _hdrStep;
+    uint16_t _hdrCount;
+    uint8_t _trailer[8];
+    uint8_t _trailerLen;
+    uint32_t _crc;
+    size_t _totalOut;
+};
+
+/*
+  Read only Stream that inflates a gzip source, so every install path that reads
+  a Stream can consume compressed images. seek() is forward only unless a rewind
+  function for the source is given.
+*/
+class GzStream : public Stream {
+public:
+    GzStream(Stream &source, std::function<bool()> rewind = nullptr);
+    ~GzStream();
+
+    bool begin();
+    void end();
+
+    bool seek(size_t pos);
+    size_t position() { return _pos; }
+
+    // Inflates (and drops) whatever is left of the source, true when the gzip
+    // trailer was reached and its CRC32 and ISIZE match the inflated data
+    bool finished();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    bool _fill();
+
+    Stream &_source;
+    std::function<bool()> _rewind;
+    GzInflater _inflater;
+    uint8_t *_input;
+    const uint8_t *_inPtr;
+    size_t _inLen;
+    uint8_t *_window;
+    size_t _winLen;
+    size_t _pos;
+};
+
+/*
+  Read only Stream over an uncompressed source with the same forward seek() as
+  GzStream, so one install path demultiplexes both kinds of images.
+*/
+class ForwardStream : public Stream {
+public:
+    ForwardStream(Stream &source) : _source(source), _pos(0) {}
+
+    bool seek(size_t pos);
+    size_t position() { return _pos; }
+
+    int available() override { return _source.available(); }
+    int read() override;
+    int peek() override { return _source.peek(); }
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    Stream &_source;
+    size_t _pos;
+};
+
+/*
+  Hands the bytes read from source to the reader and copies them to copy, from
+  the same buffer. A failed copy write stops the copy, not the reading.
+*/
+class TeeStream : public Stream {
+public:
+    TeeStream(Stream &source, Print &copy) : _source(source), _copy(copy), _failed(false) {}
+
+    bool failed() { return _failed; }
+
+    int available() override { return _source.available(); }
+    int read() override;
+    int peek() override { return _source.peek(); }
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    Stream &_source;
+    Print &_copy;
+    bool _failed;
+};
+
+bool isGzipFile(File &file);
+
+size_t gzipInflatedSize(File &file);
+
+#endif
@@ -0,0 +1,226 @@
+#include "httpPool.h"
+
+struct PoolEntry {
+    String key; // scheme://host:port
+    WiFiClient *client;
+    HTTPClient *http;
+    uint32_t lastUse;
+};
+
+static PoolEntry pool[HTTP_POOL_SIZE];
+
+/***************************************************************************************
+** Function name: poolKey
+** Description:   scheme://host:port of an url, the connection it can share
+***************************************************************************************/
+static String poolKey(const String &url) {
+    int hostStart = url.indexOf("://");
+    if (hostStart < 0) return "";
+    hostStart += 3;
+    int hostEnd = url.indexOf('/', hostStart);
+    if (hostEnd < 0) hostEnd = url.length();
+    String key = url.substring(0, hostEnd);
+    if (key.indexOf(':', hostStart) < 0) key += url.startsWith("https://") ? ":443" : ":80";
+    return key;
+}
+
+static void poolDrop(PoolEntry &entry) {
+    if (entry.http) delete entry.http; // stops the connection
+    if (entry.client) delete entry.client;
+    entry.http = nullptr;
+    entry.client = nullptr;
+    entry.key = "";
+}
+
+/***************************************************************************************
+** Function name: poolGet
+** Description:   entry for the host of url, replacing the least used one if needed
+***************************************************************************************/
+static PoolEntry *poolGet(const String &url) {
+    String key = poolKey(url);
+    PoolEntry *slot = &pool[0];
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        if (pool[i].http && pool[i].key == key) {
+            slot = &pool[i];
+            goto Found;
+        }
+        if (!pool[i].http || pool[i].lastUse < slot->lastUse) slot = &pool[i];
+    }
+    poolDrop(*slot);
+    if (url.startsWith("https://")) {
+        WiFiClientSecure *secureClient = new WiFiClientSecure;
+        secureClient->setInsecure();
+        slot->client = secureClient;
+    } else {
+        slot->client = new WiFiClient;
+    }
+    slot->http = new HTTPClient;
+    slot->key = key;
+
+Found:
+    slot->lastUse = millis();
+    return slot;
+}
+
+/***************************************************************************************
+** Function name: poolRequest
+** Description:   sends one GET on the connection of entry
+***************************************************************************************/
+static int poolRequest(PoolEntry *entry, const String &url, HttpSetup &setup, const char *keys[], size_t count) {
+    HTTPClient *http = entry->http;
+    if (!http->begin(*entry->client, url)) return -1;
+    http->setReuse(true);
+    http->useHTTP10(false);
+    http->setFollowRedirects(HTTPC_DISABLE_FOLLOW_REDIRECTS);
+    http->collectHeaders(keys, count);
+    if (setup) setup(*http);
+    return http->GET();
+}
+
+/***************************************************************************************
+** Function name: httpPoolGET
+** Description:   GET over a pooled connection. Redirects are followed here, not by
+**                HTTPClient, so a connection never ends up serving another host.
+**                setup is called for every hop to add the request headers.
+***************************************************************************************/
+int httpPoolGET(HTTPClient *&http, String url, HttpSetup setup, const char *headerKeys[], size_t headerKeysCount) {
+    const char *keys[HTTP_POOL_HEADERS + 1];
+    if (headerKeysCount > HTTP_POOL_HEADERS) headerKeysCount = HTTP_POOL_HEADERS;
+    for (size_t i = 0; i < headerKeysCount; i++) keys[i] = headerKeys[i];
+    keys[headerKeysCount] = "Transfer-Encoding";
+
+    int httpResponseCode = -1;
+    http = nullptr;
+    for (int hop = 0; hop <= HTTP_POOL_REDIRECTS; hop++) {
+        PoolEntry *entry = poolGet(url);
+        httpResponseCode = poolRequest(entry, url, setup, keys, headerKeysCount + 1);
+        if (httpResponseCode < 0) {
+            // kept connection the server closed meanwhile, once more on a new one
+            poolDrop(*entry);
+            entry = poolGet(url);
+            httpResponseCode = poolRequest(entry, url, setup, keys, headerKeysCount + 1);
+        }
+        http = entry->http;
+        if (httpResponseCode != HTTP_CODE_MOVED_PERMANENTLY && httpResponseCode != HTTP_CODE_FOUND &&
+            httpResponseCode != HTTP_CODE_SEE_OTHER && httpResponseCode != HTTP_CODE_TEMPORARY_REDIRECT &&
+            httpResponseCode != HTTP_CODE_PERMANENT_REDIRECT)
+            return httpResponseCode;
+
+        String location = http->getLocation();
+        // the redirect body may still be arriving, this connection can't be trusted
+        poolDrop(*entry);
+        http = nullptr;
+        if (location == "") break;
+        if (location.startsWith("/")) location = poolKey(url) + location;
+        log_i("HttpPool: redirect to %s", location.c_str());
+        url = location;
+    }
+    return httpResponseCode;
+}
+
+/***************************************************************************************
+** Function name: httpPoolEnd
+** Description:   request done, the connection stays open if the reply allows it
+***************************************************************************************/
+void httpPoolEnd(HTTPClient *http, bool complete) {
+    if (!http) return;
+    if (!complete) {
+        WiFiClient *stream = http->getStreamPtr();
+        if (stream) stream->stop();
+    }
+    http->end();
+}
+
+/***************************************************************************************
+** Function name: httpPoolClose
+** Description:   closes every connection and frees the TLS buffers
+***************************************************************************************/
+void httpPoolClose() {
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) poolDrop(pool[i]);
+}
+
+bool httpPoolChunked(HTTPClient *http) { return http && http->header("Transfer-Encoding").equalsIgnoreCase("chunked"); }
+
+HttpBody::HttpBody(HTTPClient *http)
+    : _source(http ? http->getStreamPtr() : nullptr), _chunked(httpPoolChunked(http)), _sized(false), _left(0),
+      _started(false), _done(false) {
+    if (!_source) {
+        _done = true;
+        return;
+    }
+    if (_chunked) return;
+    int size = http->getSize();
+    _sized = size >= 0;
+    _left = _sized ? size : 0;
+    if (_sized && !_left) _done = true;
+}
+
+/***************************************************************************************
+** Function name: _nextChunk
+** Description:   reads the next chunk size line, false after the last chunk
+***************************************************************************************/
+bool HttpBody::_nextChunk() {
+    while (!_left && !_done) {
+        if (_started) _source->readStringUntil('\n'); // CRLF closing the previous chunk
+        _started = true;
+        String line = _source->readStringUntil('\n');
+        if (line == "") {
+            _done = true; // connection lost
+            break;
+        }
+        _left = strtoul(line.c_str(), NULL, 16);
+        if (!_left) {
+            // last chunk, skip the trailer up to the empty line
+            while (_source->readStringUntil('\n').length() > 1);
+            _done = true;
+        }
+    }
+    return _left > 0;
+}
+
+void HttpBody::_consumed(size_t n) {
+    if (!_chunked && !_sized) {
+        if (!n && !_source->connected()) _done = true;
+        return;
+    }
+    _left -= n;
+    if (_sized && !_left) _done = true;
+}
+
+int HttpBody::available() {
+    if (_done) return 0;
+    if (_chunked && !_left && (!_source->available() || !_nextChunk())) return 0;
+    int av = _source->available();
+    if (!_chunked && !_sized) return av;
+    return (size_t)av < _left ? av : _left;
+}
+
+int HttpBody::read() {
+    char c;
+    return readBytes(&c, 1) == 1 ? (uint8_t)c : -1;
+}
+
+int HttpBody::peek() {
+    if (_done || (_chunked && !_left && !_nextChunk())) return -1;
+    return _source->peek();
+}
+
+size_t HttpBody::readBytes(char *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length && !_done) {
+        if (_chunked && !_left && !_nextChunk()) break;
+        size_t want = length - done;
+        if (_chunked || _sized) want = want < _left ? want : _left;
+        size_t n = _source->readBytes(buffer + done, want);
+        _consumed(n);
+        if (!n) break;
+        done += n;
+    }
+    return done;
+}
+
+bool HttpBody::drain() {
+    char tmp[64];
+    while (!_done && readBytes(tmp, sizeof(tmp)));
+    return _done;
+}
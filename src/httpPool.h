@@ -0,0 +1,74 @@
+#ifndef __HTTPPOOL_H
+#define __HTTPPOOL_H
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <functional>
+
+// Hosts kept connected at the same time, each TLS connection holds ~40 KB of heap
+#ifndef HTTP_POOL_SIZE
+#define HTTP_POOL_SIZE 2
+#endif
+
+// Redirects followed by httpPoolGET
+#define HTTP_POOL_REDIRECTS 5
+
+// Response headers a caller can ask httpPoolGET to collect
+#define HTTP_POOL_HEADERS 4
+
+typedef std::function<void(HTTPClient &http)> HttpSetup;
+
+/*
+  Keep-alive HTTP/1.1 connections, one per host. The requests done in sequence
+  while browsing the hub (catalog page, version info, Range probe, download) go
+  through the same TCP/TLS connection instead of a new handshake each.
+
+  The HTTPClient returned by httpPoolGET belongs to the pool, give it back with
+  httpPoolEnd once the body was read.
+*/
+int httpPoolGET(
+    HTTPClient *&http, String url, HttpSetup setup = nullptr, const char *headerKeys[] = nullptr,
+    size_t headerKeysCount = 0
+);
+
+// complete is false when the body wasn't read to the end, the connection is closed
+void httpPoolEnd(HTTPClient *http, bool complete = true);
+
+void httpPoolClose();
+
+bool httpPoolChunked(HTTPClient *http);
+
+/*
+  Body of a reply, chunked or with a length, so a reader stops where the reply
+  ends and the kept connection can take the next request. Replies with neither
+  end when the server closes the connection. finished() is true at the end.
+*/
+class HttpBody : public Stream {
+public:
+    HttpBody(HTTPClient *http);
+
+    bool finished() { return _done; }
+    bool chunked() { return _chunked; }
+    // reads what is left of the body, true if its end was reached
+    bool drain();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t readBytes(char *buffer, size_t length) override;
+    using Stream::readBytes;
+    size_t write(uint8_t) override { return 0; }
+
+private:
+    bool _nextChunk();
+    void _consumed(size_t n);
+
+    WiFiClient *_source;
+    bool _chunked;
+    bool _sized;
+    size_t _left; // of the body, or of the current chunk
+    bool _started;
+    bool _done;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "hubMirrors.h"
+#include <HTTPClient.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <globals.h>
+
+struct Mirror {
+    String base;
+    bool cdn;
+    uint32_t ttfb;     // ms, 0 until measured
+    uint32_t rate;     // bytes/s, 0 until measured
+    uint32_t failedAt; // millis() of the last failure, 0 while healthy
+};
+
+static std::vector<Mirror> mirrors;
+static String configured = ""; // settings the list was built from
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t probeTask = NULL;
+static String cdnObject = "";  // file of the catalog, relative to the CDN, the CDNs are probed with
+static String hubsProbed = ""; // configurations already probed this session
+static String cdnsProbed = "";
+
+static String normalize(String base, bool cdn) {
+    base.trim();
+    if (cdn && !base.endsWith("/")) base += "/";
+    if (!cdn && base.endsWith("/")) base.remove(base.length() - 1);
+    return base;
+}
+
+/***************************************************************************************
+** Function name: mirrorsLoad
+** Description:   rebuilds the list when the settings changed, lock must be held
+***************************************************************************************/
+static void mirrorsLoad() {
+    std::vector<String> hubs = {hub_url};
+    std::vector<String> cdns = {M5_SERVER_PATH};
+    for (const String &m : hub_mirrors) hubs.push_back(m);
+    for (const String &m : cdn_mirrors) cdns.push_back(m);
+
+    String now = "";
+    for (const String &m : hubs) now += normalize(m, false) + " ";
+    for (const String &m : cdns) now += normalize(m, true) + " ";
+    if (now == configured) return;
+
+    configured = now;
+    mirrors.clear();
+    for (const String &m : hubs)
+        if (normalize(m, false) != "") mirrors.push_back({normalize(m, false), false, 0, 0, 0});
+    for (const String &m : cdns)
+        if (normalize(m, true) != "/") mirrors.push_back({normalize(m, true), true, 0, 0, 0});
+}
+
+static void mirrorsLock() {
+    if (!lock) lock = xSemaphoreCreateMutex();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    mirrorsLoad();
+}
+
+static Mirror *mirrorOf(const String &url) {
+    for (Mirror &m : mirrors)
+        if (url.startsWith(m.base)) return &m;
+    return nullptr;
+}
+
+/***************************************************************************************
+** Function name: mirrorBest
+** Description:   fastest healthy mirror of a kind. The first configured one wins
+**                until others are measured; with all of them failing, the one that
+**                failed longest ago is tried again.
+***************************************************************************************/
+static String mirrorBest(bool cdn) {
+    const Mirror *best = nullptr;
+    const Mirror *oldest = nullptr;
+    uint32_t bestScore = UINT32_MAX;
+    mirrorsLock();
+    for (const Mirror &m : mirrors) {
+        if (m.cdn != cdn) continue;
+        if (m.failedAt && millis() - m.failedAt < MIRROR_RETRY_MS) {
+            if (!oldest || m.failedAt < oldest->failedAt) oldest = &m;
+            continue;
+        }
+        uint32_t score = UINT32_MAX - 1; // not measured yet
+        if (m.ttfb) score = m.ttfb + (m.rate ? (uint64_t)MIRROR_REFERENCE_BYTES * 1000 / m.rate : 0);
+        if (!best || score < bestScore) {
+            best = &m;
+            bestScore = score;
+        }
+    }
+    if (!best) best = oldest;
+    String base = best ? best->base : "";
+    xSemaphoreGive(lock);
+    return base;
+}
+
+String hubBase() { return mirrorBest(false); }
+
+String cdnBase() { return mirrorBest(true); }
+
+void mirrorFailed(const String &url) {
+    mirrorsLock();
+    Mirror *m = mirrorOf(url);
+    if (m) {
+        m->failedAt = millis() | 1;
+        log_i("Mirror: %s failed", m->base.c_str());
+    }
+    xSemaphoreGive(lock);
+}
+
+void mirrorReport(const String &url, uint32_t ttfb, size_t bytes, uint32_t ms) {
+    mirrorsLock();
+    Mirror *m = mirrorOf(url);
+    if (m) {
+        // the average with the previous measure smooths out a single slow request
+        if (ttfb) m->ttfb = m->ttfb ? (m->ttfb + ttfb) / 2 : ttfb;
+        if (bytes >= 4096 && ms) {
+            uint32_t rate = (uint64_t)bytes * 1000 / ms;
+            m->rate = m->rate ? (m->rate + rate) / 2 : rate;
+        }
+        m->failedAt = 0;
+    }
+    xSemaphoreGive(lock);
+}
+
+/***************************************************************************************
+** Function name: mirrorProbe
+** Description:   times one request to a mirror: a catalog page of a hub, a HEAD of
+**                a firmware the catalog lists for a CDN. Only a 2xx/3xx reply counts,
+**                an error page comes fast and would rank a broken mirror first.
+***************************************************************************************/
+static void mirrorProbe(const String &base, bool cdn, const String &object) {
+    String url = cdn ? base + object : base + "/firmwares?category=" + String(OTA_TAG);
+    WiFiClient *client;
+    if (url.startsWith("https://")) {
+        WiFiClientSecure *secureClient = new WiFiClientSecure;
+        secureClient->setInsecure();
+        client = secureClient;
+    } else {
+        client = new WiFiClient;
+    }
+    HTTPClient http;
+    uint32_t start = millis();
+    http.begin(*client, url);
+    http.useHTTP10(true);
+    http.setTimeout(5000);
+    int httpResponseCode = cdn ? http.sendRequest("HEAD") : http.GET();
+    uint32_t ttfb = millis() - start;
+    if (httpResponseCode < 200 || httpResponseCode >= 400) {
+        log_i("Mirror: %s unreachable (%d)", base.c_str(), httpResponseCode);
+        mirrorFailed(base);
+    } else {
+        char tmp[256];
+        size_t bytes = 0;
+        start = millis();
+        WiFiClient *stream = cdn ? nullptr : http.getStreamPtr();
+        while (stream && bytes < MIRROR_PROBE_BYTES) {
+            size_t n = stream->readBytes(tmp, sizeof(tmp));
+            if (!n) break;
+            bytes += n;
+        }
+        uint32_t ms = millis() - start;
+        log_i("Mirror: %s first byte %d ms, %d bytes in %d ms", base.c_str(), ttfb, bytes, ms);
+        mirrorReport(base, ttfb ? ttfb : 1, bytes, ms);
+    }
+    http.end();
+    delete client;
+}
+
+// kinds of mirrors not probed yet for the current settings, lock must be held
+static bool probeHubsPending() { return hubsProbed != configured; }
+
+static bool probeCdnsPending() { return cdnObject != "" && cdnsProbed != configured; }
+
+static void mirrorsProbeTask(void *pvParameters) {
+    // runs again when the CDN object arrives while the hubs are probed
+    for (;;) {
+        std::vector<Mirror> list;
+        mirrorsLock();
+        bool probeHubs = probeHubsPending();
+        bool probeCdns = probeCdnsPending();
+        hubsProbed = configured;
+        if (probeCdns) cdnsProbed = configured;
+        String object = cdnObject;
+        list = mirrors;
+        // cleared under the lock, a CDN object given from now on starts a new task
+        if (!probeHubs && !probeCdns) probeTask = NULL;
+        xSemaphoreGive(lock);
+        if (!probeHubs && !probeCdns) break;
+
+        // with a single mirror of a kind there is nothing to choose
+        int hubs = 0;
+        for (const Mirror &m : list) hubs += m.cdn ? 0 : 1;
+        for (const Mirror &m : list) {
+            if (WiFi.status() != WL_CONNECTED) break;
+            if (!(m.cdn ? probeCdns : probeHubs)) continue;
+            if ((m.cdn ? list.size() - hubs : hubs) < 2) continue;
+            mirrorProbe(m.base, m.cdn, object);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************************
+** Function name: mirrorsProbe
+** Description:   probes the mirrors in a background task, once per session. The
+**                CDNs wait for mirrorsCdnObject to give them something to fetch
+***************************************************************************************/
+void mirrorsProbe() {
+    if (WiFi.status() != WL_CONNECTED) return;
+    mirrorsLock();
+    if (!probeTask && (probeHubsPending() || probeCdnsPending()))
+        xTaskCreate(mirrorsProbeTask, "mirrorProbe", 8192, NULL, 1, &probeTask);
+    xSemaphoreGive(lock);
+}
+
+void mirrorsCdnObject(const String &file) {
+    if (file == "" || file.startsWith("https://") || file.startsWith("http://")) return;
+    mirrorsLock();
+    bool first = cdnObject == "";
+    if (first) cdnObject = file;
+    xSemaphoreGive(lock);
+    if (first) mirrorsProbe();
+}
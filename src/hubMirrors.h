@@ -0,0 +1,46 @@
+#ifndef __HUBMIRRORS_H
+#define __HUBMIRRORS_H
+#include <Arduino.h>
+
+// Firmware CDN used when no other is configured
+#define M5_SERVER_PATH "https://m5burner-cdn.m5stack.com/firmware/"
+
+// A mirror that failed is left out of the ranking for this long (ms)
+#ifndef MIRROR_RETRY_MS
+#define MIRROR_RETRY_MS 60000
+#endif
+
+// Bytes of the probe reply read to measure throughput
+#define MIRROR_PROBE_BYTES 16384
+
+// Ranking is the expected time to get this many bytes: first byte time plus transfer
+#define MIRROR_REFERENCE_BYTES 65536
+
+/*
+  Hub and firmware CDN mirrors: hub_url and hub_mirrors, M5_SERVER_PATH and
+  cdn_mirrors from the settings. They are probed in the background, the hubs when
+  the hub is opened and the CDNs once a catalog file is known, and ranked by time
+  to first byte and throughput. Requests go to the
+  best healthy one, and a mirror that fails is skipped for MIRROR_RETRY_MS so the
+  next request goes to the next best.
+
+  Until the probe is done the first configured mirror is used.
+*/
+void mirrorsProbe();
+
+// A firmware file of the catalog, relative to the CDN: the CDNs are probed with a HEAD of it
+void mirrorsCdnObject(const String &file);
+
+// Best hub, without the trailing '/'
+String hubBase();
+
+// Best firmware CDN, with the trailing '/'
+String cdnBase();
+
+// A request to url failed at the network level or with a server error
+void mirrorFailed(const String &url);
+
+// Measures of a request to url, ttfb 0 when it wasn't measured
+void mirrorReport(const String &url, uint32_t ttfb, size_t bytes, uint32_t ms);
+
+#endif
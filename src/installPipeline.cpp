@@ -0,0 +1,141 @@
+#include "installPipeline.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#define PIPELINE_MAX_SLOTS 8
+// Room for TLS record decryption when the source is a secure connection
+#define PIPELINE_READER_STACK 6144
+
+struct PipelineCtx {
+    Stream *source;
+    size_t size;
+    size_t slotSize;
+    uint8_t slots;
+    uint8_t *buffer[PIPELINE_MAX_SLOTS];
+    size_t length[PIPELINE_MAX_SLOTS];
+    QueueHandle_t freeQueue;  // buffers ready to be filled by the reader
+    QueueHandle_t fullQueue;  // buffers ready to be written by the sink
+    SemaphoreHandle_t done;   // given by the reader when it leaves
+    volatile bool abort;
+};
+
+/***************************************************************************************
+** Function name: pipelineReader
+** Description:   task that fills free buffers from the source and hands them to the
+**                writer. A zero length buffer tells the writer the source is over.
+***************************************************************************************/
+static void pipelineReader(void *param) {
+    PipelineCtx *ctx = (PipelineCtx *)param;
+    size_t remaining = ctx->size;
+    uint8_t idx;
+
+    while (remaining > 0 && !ctx->abort) {
+        if (xQueueReceive(ctx->freeQueue, &idx, portMAX_DELAY) != pdTRUE) continue;
+        if (ctx->abort) break;
+        size_t want = remaining < ctx->slotSize ? remaining : ctx->slotSize;
+        size_t got = 0;
+        // fill the whole slot, so the writer always receives full sectors
+        while (got < want) {
+            size_t r = ctx->source->readBytes((char *)ctx->buffer[idx] + got, want - got);
+            if (r == 0) break;
+            got += r;
+        }
+        ctx->length[idx] = got;
+        xQueueSend(ctx->fullQueue, &idx, portMAX_DELAY);
+        if (got < want) break; // source ended before expected, the writer will stop here
+        remaining -= got;
+    }
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(NULL);
+}
+
+/***************************************************************************************
+** Function name: pipelineFallback
+** Description:   single threaded copy, used when there is no memory for the ring
+***************************************************************************************/
+static size_t pipelineFallback(Stream &source, size_t size, PipelineSink &sink) {
+    uint8_t buf[1024];
+    size_t written = 0;
+    while (written < size) {
+        size_t want = size - written < sizeof(buf) ? size - written : sizeof(buf);
+        size_t got = source.readBytes((char *)buf, want);
+        if (got == 0) break;
+        if (!sink(buf, got)) break;
+        written += got;
+    }
+    return written;
+}
+
+/***************************************************************************************
+** Function name: pipelineTransfer
+** Description:   copies size bytes from source into sink overlapping both sides.
+**                A reader task fills a ring of sector sized buffers while the calling
+**                task drains them into the sink (flash erase/program), so SD reads
+**                happen while the flash is busy. Returns the number of bytes accepted
+**                by the sink.
+***************************************************************************************/
+size_t pipelineTransfer(Stream &source, size_t size, PipelineSink sink, size_t slotSize, uint8_t slots) {
+    PipelineCtx ctx;
+    size_t written = 0;
+    uint8_t idx;
+
+    if (size == 0) return 0;
+    if (slots > PIPELINE_MAX_SLOTS) slots = PIPELINE_MAX_SLOTS;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.source = &source;
+    ctx.size = size;
+    ctx.slotSize = slotSize;
+    ctx.abort = false;
+
+    // allocate as many buffers as the heap allows, two is the minimum to overlap anything
+    for (ctx.slots = 0; ctx.slots < slots; ctx.slots++) {
+        ctx.buffer[ctx.slots] = (uint8_t *)malloc(slotSize);
+        if (!ctx.buffer[ctx.slots]) break;
+    }
+    if (ctx.slots < 2) {
+        log_i("Pipeline: not enough memory, using single buffer copy");
+        if (ctx.slots) free(ctx.buffer[0]);
+        return pipelineFallback(source, size, sink);
+    }
+
+    ctx.freeQueue = xQueueCreate(ctx.slots, sizeof(uint8_t));
+    ctx.fullQueue = xQueueCreate(ctx.slots, sizeof(uint8_t));
+    ctx.done = xSemaphoreCreateBinary();
+    if (!ctx.freeQueue || !ctx.fullQueue || !ctx.done) goto Fallback;
+    for (idx = 0; idx < ctx.slots; idx++) xQueueSend(ctx.freeQueue, &idx, 0);
+
+    if (xTaskCreate(pipelineReader, "pipeReader", PIPELINE_READER_STACK, &ctx, uxTaskPriorityGet(NULL), NULL) != pdPASS)
+        goto Fallback;
+
+    while (written < size) {
+        if (xQueueReceive(ctx.fullQueue, &idx, portMAX_DELAY) != pdTRUE) continue;
+        size_t len = ctx.length[idx];
+        if (len == 0 || !sink(ctx.buffer[idx], len)) {
+            xQueueSend(ctx.freeQueue, &idx, 0);
+            break;
+        }
+        written += len;
+        xQueueSend(ctx.freeQueue, &idx, 0);
+        if (len < ctx.slotSize && written < size) break; // short read, source is over
+    }
+
+    // stop the reader and give back everything it may still be holding
+    ctx.abort = true;
+    while (xSemaphoreTake(ctx.done, pdMS_TO_TICKS(10)) != pdTRUE) {
+        while (xQueueReceive(ctx.fullQueue, &idx, 0) == pdTRUE) xQueueSend(ctx.freeQueue, &idx, 0);
+    }
+    goto Exit;
+
+Fallback:
+    log_i("Pipeline: failed to start reader, using single buffer copy");
+    written = pipelineFallback(source, size, sink);
+
+Exit:
+    if (ctx.freeQueue) vQueueDelete(ctx.freeQueue);
+    if (ctx.fullQueue) vQueueDelete(ctx.fullQueue);
+    if (ctx.done) vSemaphoreDelete(ctx.done);
+    for (idx = 0; idx < ctx.slots; idx++) free(ctx.buffer[idx]);
+    return written;
+}
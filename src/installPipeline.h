@@ -0,0 +1,25 @@
+#ifndef __INSTALL_PIPELINE_H
+#define __INSTALL_PIPELINE_H
+#include <Arduino.h>
+#include <functional>
+
+// Size of each buffer of the ring, matches the flash sector so every write handed
+// to the sink keeps the destination offset sector aligned
+#ifndef PIPELINE_SLOT_SIZE
+#define PIPELINE_SLOT_SIZE 4096
+#endif
+
+// Number of buffers in the ring between the reader task and the writer
+#ifndef PIPELINE_SLOTS
+#define PIPELINE_SLOTS 4
+#endif
+
+// Receives each filled buffer, returns false to abort the transfer
+typedef std::function<bool(uint8_t *data, size_t len)> PipelineSink;
+
+size_t pipelineTransfer(
+    Stream &source, size_t size, PipelineSink sink, size_t slotSize = PIPELINE_SLOT_SIZE,
+    uint8_t slots = PIPELINE_SLOTS
+);
+
+#endif
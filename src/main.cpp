@@ -98,6 +98,7 @@ bool onlyBins;
 bool returnToMenu;
 bool update;
 bool askSpiffs;
+bool fastBoot;
 
 // bool command;
 size_t file_size;
@@ -107,10 +108,13 @@ String wui_usr = "admin";
 String wui_pwd = "launcher";
 String dwn_path = "/downloads/";
 String hub_url = "https://einkhub.com";
+std::vector<String> hub_mirrors;
+std::vector<String> cdn_mirrors;
 uint16_t total_firmware = 0;
 uint8_t current_page = 1;
 uint8_t num_pages = 0;
-JsonDocument doc;
+std::vector<CatalogItem> catalog;
+uint8_t catalog_page_size = 0;
 JsonArray favorite;
 JsonDocument settings;
 std::vector<Option> options;
@@ -124,6 +128,7 @@ uint8_t buff[1024] = {0};
 #include "partitioner.h"
 #include "sd_functions.h"
 #include "settings.h"
+#include "trace.h"
 #include "webInterface.h"
 
 /*********************************************************************
@@ -231,11 +236,63 @@ void _setup_gpio() {}
 void _post_setup_gpio() __attribute__((weak));
 void _post_setup_gpio() {}
 
+/*********************************************************************
+**  Function: _check_launcher_chord()
+**  Buttons held at power on to stay in the Launcher when fast boot is on.
+**  Weak, replaced by /ports/* /interface.h. Boards without a select
+**  button always stay, there would be no way back otherwise.
+*********************************************************************/
+bool _check_launcher_chord() __attribute__((weak));
+bool _check_launcher_chord() {
+#if defined(SEL_BTN) && SEL_BTN >= 0 && defined(BTN_ACT)
+    pinMode(SEL_BTN, BTN_ACT == LOW ? INPUT_PULLUP : INPUT_PULLDOWN);
+    delay(5);
+    return digitalRead(SEL_BTN) == BTN_ACT;
+#else
+    return true;
+#endif
+}
+
+/*********************************************************************
+**  Function: fastBootCheck
+**  Restarts into ota_0 before the display and the SD card are started,
+**  when fast boot is on and nothing asks to stay in the Launcher
+*********************************************************************/
+void fastBootCheck() {
+    if (!fastBoot) return;
+    // asked from the Launcher UI before it restarted (e.g. after repartitioning)
+    if (takeStayInLauncher()) return;
+    // freshly installed through OTA, partitionCrawler still has to move it
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (!running || running->subtype != TARGET_PARTITION) return;
+
+    const esp_partition_t *ota_partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    uint8_t firstByte = 0;
+    esp_app_desc_t desc;
+    if (!ota_partition || esp_partition_read(ota_partition, 0, &firstByte, 1) != ESP_OK || firstByte != 0xE9 ||
+        esp_ota_get_partition_description(ota_partition, &desc) != ESP_OK)
+        return;
+    if (_check_launcher_chord()) return;
+
+    log_i("Fast boot: starting %s", desc.project_name);
+    TRACE_MARK("fast boot");
+    startInstalledApp();
+}
+
 /*********************************************************************
 **  Function: setup
 **  Where the devices are started and variables set
 *********************************************************************/
 void setup() {
+#ifdef LAUNCHER_TRACE
+    traceBegin();
+    // declared before the span, so the timeline is printed once setup() returns, with the span in it
+    struct TraceDumpOnReturn {
+        ~TraceDumpOnReturn() { traceDump(Serial); }
+    } traceDumpOnReturn;
+#endif
+    TRACE_SPAN("setup");
     nvs_flash_init();
 #if CONFIG_IDF_TARGET_ESP32P4
     const esp_partition_t *partition =
@@ -280,6 +337,7 @@ void setup() {
 
     // Get Configuration from NVS partition
     getFromNVS();
+    fastBootCheck();
 
     // declare variables
     size_t currentIndex = 0;
@@ -370,35 +428,24 @@ void setup() {
         if (check(AnyKeyPress))
 #endif
         {
+            TRACE_MARK("start app (key)");
             tft->fillScreen(BLACK);
-            FREE_TFT
-#if CONFIG_IDF_TARGET_ESP32P4
-            const esp_partition_t *partition =
-                esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-            esp_ota_set_boot_partition(partition);
-            ESP.deepSleep(100);
-#endif
-            ESP.restart();
+            startInstalledApp();
         }
     }
 
     // If nothing is done, check if there are any app installed in the ota partition, if it does, restart
     // device to start installed App.
     if (firstByte == 0xE9) {
+        TRACE_MARK("start app");
         tft->fillScreen(BLACK);
-        FREE_TFT
-#if CONFIG_IDF_TARGET_ESP32P4
-        const esp_partition_t *partition =
-            esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-        esp_ota_set_boot_partition(partition);
-        ESP.deepSleep(100);
-#endif
-        ESP.restart();
+        startInstalledApp();
     } else goto Launcher;
 
 // If M5 or Enter button is pressed, continue from here
 Launcher:
     LongPress = false;
+    TRACE_MARK("menu");
     tft->fillScreen(BGCOLOR);
 #if LED > 0 && defined(HEADLESS)
     digitalWrite(LED, LED_ON ? LOW : HIGH); // turn off the LED
@@ -1,19 +1,42 @@
 #include "onlineLauncher.h"
+#include "catalogCache.h"
+#include "catalogPrefetch.h"
+#include "deltaUpdate.h"
 #include "display.h"
+#include "fwIndex.h"
+#include "gzStream.h"
+#include "httpPool.h"
+#include "hubMirrors.h"
+#include "installPipeline.h"
 #include "mykeyboard.h"
+#include "partitioner.h"
 #include "powerSave.h"
 #include "sd_functions.h"
 #include "settings.h"
+#include "trace.h"
+#include <esp_ota_ops.h>
 #include <globals.h>
 
-#define M5_SERVER_PATH "https://m5burner-cdn.m5stack.com/firmware/"
+// Failed requests in a row before a download is left paused
+#define DOWNLOAD_ATTEMPTS 5
+// Download progress is recorded in the sidecar every DOWNLOAD_CHECKPOINT bytes
+#define DOWNLOAD_CHECKPOINT 65536
+// Downloads are written to the SD in blocks of this size, a multiple of the FAT cluster
+#ifndef DOWNLOAD_SLOT_SIZE
+#define DOWNLOAD_SLOT_SIZE 16384
+#endif
+#define DOWNLOAD_SLOTS 4
+// Bytes between partitions an install may read and drop to avoid a request per partition
+#ifndef STREAM_INSTALL_MAX_GAP
+#define STREAM_INSTALL_MAX_GAP (1024 * 1024)
+#endif
 
-static String getHubBaseUrl() {
-    String base = hub_url;
-    base.trim();
-    if (base.endsWith("/")) base.remove(base.length() - 1);
-    return base;
-}
+// Partition written from an image in a single stream install
+struct StreamRegion {
+    uint32_t offset;
+    uint32_t size;
+    const char *label; // app, spiffs, sys or vfs
+};
 
 /***************************************************************************************
 ** Function name: wifiConnect
@@ -122,6 +145,27 @@ void connectWifi() {
     options.push_back({"Main Menu", [=]() { returnToMenu = true; }});
     loopOptions(options);
 }
+#ifndef DISABLE_OTA
+/***************************************************************************************
+** Function name: catalogPath
+** Description:   hub path of a catalog page, also the key of its cached copy.
+**                Paths are the same on every hub mirror.
+***************************************************************************************/
+String catalogPath(uint8_t page, String order, bool star, String query) {
+    String q = "&order_by=" + order;
+    q += page > 1 ? "&page=" + String(page) : "";
+    q += query.length() > 0 ? "&q=" + String(query) : "";
+    q += star ? "&star=1" : "";
+    return "/firmwares?category=" + String(OTA_TAG) + q;
+}
+
+/***************************************************************************************
+** Function name: versionsPath
+** Description:   hub path of the version document of a firmware
+***************************************************************************************/
+String versionsPath(String fid) { return "/firmwares?fid=" + fid; }
+#endif
+
 /***************************************************************************************
 ** Function name: ota_function
 ** Description:   Start OTA function
@@ -129,8 +173,20 @@ void connectWifi() {
 void ota_function() {
 #ifndef DISABLE_OTA
     bool fav = false;
-    if (WiFi.status() != WL_CONNECTED) connectWifi();
-    if (WiFi.status() == WL_CONNECTED) {
+    bool offline = false;
+    // with a cached catalog the list can be browsed before (or without) connecting
+    if (WiFi.status() != WL_CONNECTED && catalogCacheHas(catalogPath(1, "downloads", false, ""))) {
+        options = {
+            {"Connect WiFi",   [&]() { offline = false; }    },
+            {"Browse offline", [&]() { offline = true; }     },
+            {"Main Menu",      [=]() { returnToMenu = true; }}
+        };
+        loopOptions(options);
+        if (returnToMenu) return;
+    }
+    if (WiFi.status() != WL_CONNECTED && !offline) connectWifi();
+    if (WiFi.status() == WL_CONNECTED || offline) {
+        mirrorsProbe(); // ranks the hub and CDN mirrors while the first page is read
         // Debug
         // Serial.printf("Favorite size: %d\n", favorite.size());
         // serializeJsonPretty(favorite, Serial);
@@ -178,6 +234,8 @@ void ota_function() {
         } else {
             if (GetJsonFromEinkHub()) loopFirmware();
         }
+        prefetchEnd();
+        httpPoolClose(); // leaving the hub, no more requests to keep connections for
     }
     tft->fillScreen(BGCOLOR);
 #endif
@@ -202,19 +260,47 @@ String replaceChars(String input) {
     return input;
 }
 
-bool getInfo(String serverUrl, JsonDocument &_doc) {
+/***************************************************************************************
+** Function name: parseInfo
+** Description:   parses a hub reply into _doc, keeping only what filter asks for.
+**                The rest of the reply is read too, so the connection (and the
+**                cached copy) gets all of it.
+***************************************************************************************/
+static bool parseInfo(Stream &reply, JsonDocument &_doc, JsonDocument &filter) {
+    char rest[64];
+    _doc.clear();
+    DeserializationError error = deserializeJson(_doc, reply, DeserializationOption::Filter(filter));
+    while (reply.readBytes(rest, sizeof(rest)));
+    if (error) {
+        Serial.printf("[GetInfo] Failed to parse JSON: %s\n", error.c_str());
+        displayRedStripe("JSON Parse Failed");
+        vTaskDelay(1500 / portTICK_PERIOD_MS);
+        _doc.clear();
+        return false;
+    }
+    Serial.printf("[GetInfo] Parsed json with size: %d\n", _doc.size());
+    return true;
+}
+
+/***************************************************************************************
+** Function name: getInfo
+** Description:   gets a hub reply, from the catalog cache when it is recent or when
+**                there is no network, revalidating it with If-None-Match otherwise.
+**                The reply is parsed as it arrives, it is never held whole in RAM.
+**                A hub mirror that fails is replaced by the next best one.
+***************************************************************************************/
+bool getInfo(String path, JsonDocument &_doc, JsonDocument &filter) {
+    String etag = "";
+    bool fresh = false;
+    bool cached = catalogCacheLookup(path, etag, fresh);
+    auto parse = [&](Stream &reply) { return parseInfo(reply, _doc, filter); };
+    if (cached && (fresh || WiFi.status() != WL_CONNECTED)) {
+        Serial.printf("[GetInfo] Using cached %s\n", path.c_str());
+        return catalogCacheParse(path, parse);
+    }
+
     if (WiFi.status() == WL_CONNECTED) {
         vTaskSuspend(xHandle);
-        WiFiClient *client = nullptr;
-        WiFiClientSecure *secureClient = nullptr;
-        if (serverUrl.startsWith("https://")) {
-            secureClient = new WiFiClientSecure();
-            secureClient->setInsecure();
-            client = secureClient;
-        } else {
-            client = new WiFiClient();
-        }
-        HTTPClient http;
         resetTftDisplay();
         tft->drawRoundRect(5, 5, tftWidth - 10, tftHeight - 10, 5, FGCOLOR);
         tft->drawCentreString("Getting info from", tftWidth / 2, tftHeight / 3, 1);
@@ -224,58 +310,84 @@ bool getInfo(String serverUrl, JsonDocument &_doc) {
 #endif
         tft->setCursor(18, tftHeight / 3 + FM * 9 * 2);
         const uint8_t maxAttempts = 5;
+        const char *headerKeys[] = {"ETag"};
         for (uint8_t attempt = 0; attempt < maxAttempts; ++attempt) {
-            if (!http.begin(*client, serverUrl)) {
-                Serial.printf("[GetInfo] Unable to reach %s\n", serverUrl);
-                break;
+            // kept-alive connection to the hub, shared by the catalog and version requests
+            String serverUrl = hubBase() + path;
+            HTTPClient *http = nullptr;
+            int httpResponseCode = httpPoolGET(
+                http,
+                serverUrl,
+                [&](HTTPClient &request) {
+                    if (cached && etag != "") request.addHeader("If-None-Match", etag);
+                },
+                headerKeys,
+                1
+            );
+            if (!http || httpResponseCode < 0 || httpResponseCode >= 500) {
+                // the next attempt goes to another mirror, if there is one
+                Serial.printf("[GetInfo] Unable to reach %s (%d)\n", serverUrl.c_str(), httpResponseCode);
+                mirrorFailed(serverUrl);
+                httpPoolEnd(http, false);
+                tftprint(".", 10);
+                continue;
+            }
+            if (httpResponseCode == HTTP_CODE_NOT_MODIFIED) {
+                httpPoolEnd(http);
+                catalogCacheTouch(path);
+                vTaskResume(xHandle);
+                return catalogCacheParse(path, parse);
             }
-            http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
-            http.useHTTP10(true);
-            int httpResponseCode = http.GET();
             if (httpResponseCode == HTTP_CODE_OK) {
-                String payload = http.getString();
-                http.end();
-                _doc.clear();
-                DeserializationError error = deserializeJson(_doc, payload);
-                if (error) {
-                    Serial.printf("[GetInfo] Failed to parse JSON: %s\n", error.c_str());
-                    displayRedStripe("JSON Parse Failed");
-                    vTaskDelay(1500 / portTICK_PERIOD_MS);
-                    _doc.clear();
-                    vTaskResume(xHandle);
-                    return false;
-                }
-                Serial.printf("[GetInfo] Downloaded and parsed json with size: %d\n", _doc.size());
+                HttpBody body(http);
+                bool ok = catalogCacheStore(path, http->header("ETag"), body, parse);
+                httpPoolEnd(http, body.finished());
                 vTaskResume(xHandle);
-                delete client;
-                return true;
+                return ok;
             }
 
             Serial.printf("[GetInfo] HTTP error: %d\n", httpResponseCode);
             tftprint(".", 10);
-            http.end();
+            httpPoolEnd(http);
         }
-        delete client;
+        vTaskResume(xHandle);
     }
-    vTaskResume(xHandle);
+    // hub unreachable, an old copy is better than nothing
+    if (cached) return catalogCacheParse(path, parse);
     return false;
 }
 
 /***************************************************************************************
 ** Function name: GetJsonFromEinkHub
-** Description:   Gets JSON from github server
+** Description:   Gets a catalog page from the hub into the catalog list
 ***************************************************************************************/
 bool GetJsonFromEinkHub(uint8_t page, String order, bool star, String query) {
-    String q = "&order_by=" + order;
-    q += page > 1 ? "&page=" + String(page) : "";
-    q += query.length() > 0 ? "&q=" + String(query) : "";
-    q += star ? "&star=1" : "";
-    String serverUrl = getHubBaseUrl() + "/firmwares?category=" + String(OTA_TAG) + q;
+    String path = catalogPath(page, order, star, query);
+    // only what the firmware list shows
+    JsonDocument filter;
+    filter["total"] = true;
+    filter["page_size"] = true;
+    JsonObject itemFilter = filter["items"].add<JsonObject>();
+    itemFilter["name"] = true;
+    itemFilter["author"] = true;
+    itemFilter["star"] = true;
+    itemFilter["fid"] = true;
 
-    if (getInfo(serverUrl, doc)) {
-        total_firmware = doc["total"].as<int>();
-        num_pages = doc["total"].as<int>() / doc["page_size"].as<int>();
+    JsonDocument reply;
+    if (getInfo(path, reply, filter)) {
+        total_firmware = reply["total"].as<int>();
+        catalog_page_size = reply["page_size"].as<int>();
+        num_pages = catalog_page_size ? total_firmware / catalog_page_size : 0;
         current_page = page;
+        catalog.clear();
+        JsonArray items = reply["items"];
+        catalog.reserve(items.size());
+        for (JsonObject item : items) {
+            catalog.push_back(
+                {item["name"].as<String>(), item["author"].as<String>(), item["fid"].as<String>(),
+                 item["star"].as<bool>()}
+            );
+        }
         Serial.printf("GetJsonFromEinkHub> Loaded %d firmwares\n", total_firmware);
         return true;
     }
@@ -284,130 +396,292 @@ bool GetJsonFromEinkHub(uint8_t page, String order, bool star, String query) {
     return false;
 }
 JsonDocument getVersionInfo(String fid) {
+    // fields used by loopVersions
+    JsonDocument filter;
+    filter["name"] = true;
+    filter["author"] = true;
+    filter["fid"] = true;
+    filter["star"] = true;
+    JsonObject versionFilter = filter["versions"].add<JsonObject>();
+    const char *versionKeys[] = {
+        "version", "published_at", "file", "sha256", "s", "f", "f2", "nb", "as", "ss", "so", "fs", "fo", "fs2", "fo2",
+        "delta"
+    };
+    for (const char *key : versionKeys) versionFilter[key] = true;
+
     JsonDocument versions;
-    String serverUrl = getHubBaseUrl() + "/firmwares?fid=" + fid;
-    if (!getInfo(serverUrl, versions)) {
+    if (!getInfo(versionsPath(fid), versions, filter)) {
         displayRedStripe("Version fetch Failed");
         vTaskDelay(1500 / portTICK_PERIOD_MS);
     }
+    mirrorsCdnObject(versions["versions"][0]["file"] | "");
     return versions;
 }
+/***************************************************************************************
+** Function name: firmwarePath
+** Description:   where a hub firmware is saved on the SD
+***************************************************************************************/
+String firmwarePath(String file, String fileName, String folder) {
+    // compressed images are kept compressed on the SD, updateFromSD inflates them
+    String fileExt = file.endsWith(".gz") ? ".bin.gz" : ".bin";
+    return folder + replaceChars(fileName) + fileExt;
+}
+
+/***************************************************************************************
+** Function name: saveDownloadSession
+** Description:   writes the sidecar of a .part file, bytes is what is safe on the SD
+***************************************************************************************/
+static void saveDownloadSession(String path, String key, String etag, size_t bytes, size_t total) {
+    JsonDocument session;
+    session["key"] = key;
+    session["etag"] = etag;
+    session["bytes"] = bytes;
+    session["total"] = total;
+    File f = SDM.open(path, FILE_WRITE);
+    if (!f) return;
+    serializeJson(session, f);
+    f.close();
+}
+
+/***************************************************************************************
+** Function name: loadDownloadSession
+** Description:   reads the sidecar of a .part file, false if it is from another file
+***************************************************************************************/
+static bool loadDownloadSession(String path, String key, String &etag, size_t &bytes, size_t &total) {
+    JsonDocument session;
+    File f = SDM.open(path);
+    if (!f) return false;
+    DeserializationError error = deserializeJson(session, f);
+    f.close();
+    if (error || session["key"].as<String>() != key) return false;
+    etag = session["etag"].as<String>();
+    bytes = session["bytes"].as<size_t>();
+    total = session["total"].as<size_t>();
+    return true;
+}
+
 /***************************************************************************************
 ** Function name: downloadFirmware
 ** Description:   Downloads the firmware and save into the SDCard
+**                Data goes to a .part file with a .part.json sidecar (key, ETag, bytes),
+**                dropped connections and reboots resume with a Range request.
 ***************************************************************************************/
 void downloadFirmware(String fid, String file, String fileName, String folder) { // Adicionar "fid"
-    if (!file.startsWith("https://")) file = M5_SERVER_PATH + file;
-    String fileAddr = getHubBaseUrl() + "/download?fid=" + fid + "&file=" + file;
-    if (fid == "") fileAddr = file;
-    int tries = 0;
-    fileName = replaceChars(fileName);
+    TRACE_SPAN("downloadFirmware");
+    // the same download from any mirror, so a paused one resumes wherever it continues
+    String sessionKey = fid + ":" + file;
+    auto mirrorAddr = [&]() -> String {
+        String source = file.startsWith("https://") ? file : cdnBase() + file;
+        if (fid == "") return source;
+        return hubBase() + "/download?fid=" + fid + "&file=" + source;
+    };
+    String fileAddr = mirrorAddr();
+    String target = firmwarePath(file, fileName, folder);
+    String partPath = target + ".part";
+    String sessionPath = partPath + ".json";
+    String etag = "";
+    size_t downloaded = 0;
+    size_t total = 0;
+    uint8_t attempts = 0;
+    bool done = false;
+    bool sdError = false;
     prog_handler = 2;
     if (!setupSdCard()) {
         displayRedStripe("SDCard Not Found");
         delay(2500);
         return;
     }
+    if (!SDM.exists("/downloads")) SDM.mkdir("/downloads");
 
-    tft->fillRect(7, 40, tftWidth - 14, 88, BGCOLOR); // Erase the information below the firmware name
-    displayRedStripe("Connecting FW");
-    WiFiClient *client = nullptr;
-    WiFiClientSecure *secureClient = nullptr;
-    if (fileAddr.startsWith("https://")) {
-        secureClient = new WiFiClientSecure;
-        secureClient->setInsecure();
-        client = secureClient;
+    // a previous session of this same file continues where it stopped
+    if (SDM.exists(partPath) && loadDownloadSession(sessionPath, sessionKey, etag, downloaded, total)) {
+        File part = SDM.open(partPath);
+        if (!part || part.size() < downloaded) downloaded = part ? part.size() : 0;
+        part.close();
+        // resume on a block boundary, so every write stays cluster aligned
+        downloaded -= downloaded % DOWNLOAD_SLOT_SIZE;
+        Serial.printf("Download> Resuming %s at %d of %d\n", partPath.c_str(), downloaded, total);
     } else {
-        client = new WiFiClient;
+        downloaded = 0;
+        total = 0;
+        etag = "";
     }
-retry:
-    if (client) {
-        HTTPClient http;
-        int httpResponseCode = -1;
 
-        while (httpResponseCode < 0) {
-            http.begin(*client, fileAddr);
-            http.addHeader("HWID", WiFi.macAddress());
-            http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS); // Github links need it
-            http.useHTTP10(true);
-            httpResponseCode = http.GET();
-            if (httpResponseCode > 0) {
-                setupSdCard();
-                if (!SDM.exists("/downloads")) SDM.mkdir("/downloads");
-
-                File file = SDM.open(folder + fileName + ".bin", FILE_WRITE, true);
-                size_t size = http.getSize();
-                displayRedStripe("Downloading FW");
-                if (file) {
-                    vTaskSuspend(xHandle);
-                    int downloaded = 0;
-                    WiFiClient *stream = http.getStreamPtr();
-                    int len = size;
-
-                    prog_handler = 2; // Download handler
-
-                    // Ler dados enquanto disponível
-                    progressHandler(downloaded, size);
-                    while (http.connected() && (len > 0 || len == -1)) {
-                        // Ler dados em partes
-                        int size_av = stream->available();
-                        if (size_av) {
-                            int c = stream->readBytes(buff, size_av < bufSize ? size_av : bufSize);
-                            if (c <= 0) continue;
-                            size_t wrote = file.write(buff, c);
-                            if (wrote != static_cast<size_t>(c)) {
-                                log_i("Download> write failed after %d bytes", downloaded);
-                                break;
-                            }
-
-                            if (len > 0) { len -= c; }
-
-                            downloaded += c;
-                            tft->drawPixel(0, 0, 0);
-                            progressHandler(downloaded, size); // Chama a função de progresso
-                        }
-                    }
-                    file.flush();
-                    file.close();
-                    vTaskResume(xHandle);
-                } else {
-                    Serial.printf("Download> Couldn't create file %s\n", String(folder + fileName + ".bin"));
-                    displayRedStripe("Fail creating file.");
-                }
-                // Checks if the file was preatically not downloaded and try one more time (size <=
-                // bufSize)
-                vTaskDelay(pdTICKS_TO_MS(50));
-                file = SDM.open(folder + fileName + ".bin");
-                if (file.size() <= bufSize & tries < 1) {
-                    tries++;
-                    http.end();
-                    goto retry;
-                }
-                // Checks if the file was completely downloaded
-                Serial.printf("File size in get() = %d\nFile size in SD    = %d\n", size, file.size());
-                if (file.size() != size) {
-                    SDM.remove(file.path());
-                    displayRedStripe("Download FAILED");
-                    while (!check(SelPress)) yield();
-                } else {
-                    Serial.printf("File successfully downloaded.\n");
-                    displayRedStripe(" Downloaded ");
-                    while (!check(SelPress)) yield();
+    tft->fillRect(7, 40, tftWidth - 14, 88, BGCOLOR); // Erase the information below the firmware name
+    displayRedStripe("Connecting FW");
+
+    vTaskSuspend(xHandle);
+    while (!done && !sdError && attempts < DOWNLOAD_ATTEMPTS) {
+        HTTPClient *http = nullptr;
+        const char *headerKeys[] = {"Content-Range", "ETag"};
+        const size_t headerKeysCount = sizeof(headerKeys) / sizeof(headerKeys[0]);
+        size_t start = downloaded;
+
+        int httpResponseCode = httpPoolGET(
+            http,
+            fileAddr,
+            [&](HTTPClient &request) {
+                request.addHeader("HWID", WiFi.macAddress());
+                if (downloaded > 0) {
+                    request.addHeader("Range", "bytes=" + String(downloaded) + "-");
+                    // the server sends the whole file (200) if it changed since the first request
+                    if (etag != "") request.addHeader("If-Range", etag);
                 }
-                file.close();
+            },
+            headerKeys,
+            headerKeysCount
+        );
+
+        if (httpResponseCode == HTTP_CODE_PARTIAL_CONTENT) {
+            // Content-Range: bytes <first>-<last>/<total>
+            String range = http->header("Content-Range");
+            size_t first = range.substring(range.indexOf(' ') + 1, range.indexOf('-')).toInt();
+            total = range.substring(range.lastIndexOf('/') + 1).toInt();
+            if (first != downloaded) {
+                log_i("Download> server resumed at %d instead of %d", first, downloaded);
+                downloaded = 0;
+                httpPoolEnd(http, false);
+                continue;
+            }
+        } else if (httpResponseCode == HTTP_CODE_OK) {
+            downloaded = 0; // no ranges or the file changed, start over
+            total = http->getSize() > 0 ? http->getSize() : 0;
+        } else if (httpResponseCode == HTTP_CODE_RANGE_NOT_SATISFIABLE && total && downloaded >= total) {
+            done = true; // everything was already here
+            httpPoolEnd(http);
+            break;
+        } else {
+            Serial.printf("Download> HTTP error: %d\n", httpResponseCode);
+            if (httpResponseCode == HTTP_CODE_RANGE_NOT_SATISFIABLE) downloaded = 0;
+            if (httpResponseCode < 0 || httpResponseCode >= 500) {
+                // Range requests continue on the next best mirror
+                mirrorFailed(fileAddr);
+                fileAddr = mirrorAddr();
+            }
+            httpPoolEnd(http, false);
+            attempts++;
+            vTaskDelay(pdMS_TO_TICKS(500 * attempts));
+            continue;
+        }
+        String newEtag = http->header("ETag");
+        if (newEtag != "") etag = newEtag;
+
+        setupSdCard();
+        File part = downloaded ? SDM.open(partPath, "r+") : SDM.open(partPath, FILE_WRITE, true);
+        if (!part || (downloaded && !part.seek(downloaded))) {
+            Serial.printf("Download> Couldn't create file %s\n", partPath.c_str());
+            displayRedStripe("Fail creating file.");
+            sdError = true;
+            httpPoolEnd(http, false);
+            break;
+        }
+        // allocate the whole cluster chain now, so it is contiguous and writes don't extend it
+        if (total > downloaded && part.size() < total) {
+            if (!part.seek(total - 1) || part.write((uint8_t)0) != 1 || !part.seek(downloaded)) {
+                Serial.printf("Download> No room for %d bytes\n", total);
+                displayRedStripe("Not enough space on SD");
+                sdError = true;
+                part.close();
+                httpPoolEnd(http, false);
                 break;
-            } else {
-                http.end();
-                vTaskDelay(pdTICKS_TO_MS(500));
             }
         }
-        http.end();
+        saveDownloadSession(sessionPath, sessionKey, etag, downloaded, total);
+        displayRedStripe("Downloading FW");
+
+        // stops at the end of the reply, chunked or not
+        HttpBody body(http);
+        size_t checkpoint = downloaded;
+        progressHandler(downloaded, total ? total : downloaded + 1);
+        // a reader task receives into the ring while this one writes full blocks to the SD
+        uint32_t transferStart = millis();
+        pipelineTransfer(
+            body,
+            total > downloaded ? total - downloaded : SIZE_MAX,
+            [&](uint8_t *data, size_t len) {
+                if (part.write(data, len) != len) {
+                    log_i("Download> write failed after %d bytes", downloaded);
+                    sdError = true;
+                    return false;
+                }
+                downloaded += len;
+                // what the sidecar says is on the SD must really be there
+                if (downloaded - checkpoint >= DOWNLOAD_CHECKPOINT) {
+                    part.flush();
+                    saveDownloadSession(sessionPath, sessionKey, etag, downloaded, total);
+                    checkpoint = downloaded;
+                }
+                progressHandler(downloaded, total ? total : downloaded + 1);
+                return true;
+            },
+            DOWNLOAD_SLOT_SIZE,
+            DOWNLOAD_SLOTS
+        );
+        mirrorReport(fileAddr, 0, downloaded - start, millis() - transferStart);
+        part.flush();
+        part.close();
+        saveDownloadSession(sessionPath, sessionKey, etag, downloaded, total);
+        // a body left half read can't be followed by another request on this connection
+        httpPoolEnd(http, body.finished());
+
+        // without a length the end of the connection is the end of the file
+        if (body.chunked() ? body.finished() : total ? downloaded >= total : downloaded > bufSize) done = true;
+        else if (downloaded > start) attempts = 0; // progress was made, keep trying
+        else {
+            attempts++;
+            mirrorFailed(fileAddr);
+            fileAddr = mirrorAddr();
+        }
+        if (!done) log_i("Download> connection dropped at %d of %d", downloaded, total);
+    }
+    vTaskResume(xHandle);
+
+    Serial.printf("File size in get() = %d\nFile size in SD    = %d\n", total, downloaded);
+    if (done) {
+        if (SDM.exists(target)) SDM.remove(target);
+        SDM.rename(partPath, target);
+        SDM.remove(sessionPath);
+        Serial.printf("File successfully downloaded.\n");
+        displayRedStripe(" Downloaded ");
     } else {
-        displayRedStripe("Couldn't Connect");
+        // .part and its sidecar stay, downloading it again resumes from here
+        displayRedStripe(sdError ? "Download FAILED" : "Download paused");
     }
-    delete client;
+    while (!check(SelPress)) yield();
     wakeUpScreen();
 }
+/***************************************************************************************
+** Function name: gzipTableProbe
+** Description:   for a .gz link, the inflated size (ISIZE, the last 4 bytes of the file)
+**                and what is at 0x8000 of the inflated image, in buff. Images that
+**                inflate to less than that leave buff erased, as plain apps.
+***************************************************************************************/
+static bool gzipTableProbe(const String &url, size_t &file_size) {
+    HTTPClient *http = nullptr;
+    uint8_t isize[4];
+    if (httpPoolGET(http, url, [](HTTPClient &request) { request.addHeader("Range", "bytes=-4"); }) != 206) {
+        httpPoolEnd(http, false);
+        return false;
+    }
+    HttpBody tail(http);
+    bool ok = tail.readBytes((char *)isize, sizeof(isize)) == sizeof(isize);
+    httpPoolEnd(http, ok && tail.drain());
+    if (!ok) return false;
+    file_size = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint32_t)isize[3] << 24);
+
+    if (httpPoolGET(http, url) != HTTP_CODE_OK) {
+        httpPoolEnd(http, false);
+        return false;
+    }
+    HttpBody body(http);
+    GzStream gz(body);
+    memset(buff, 0xFF, bufSize);
+    if (gz.begin() && gz.seek(0x8000)) gz.readBytes((char *)buff, 0x1C0);
+    gz.end();
+    httpPoolEnd(http, false); // only the first 33 KB of the image were inflated
+    return true;
+}
+
 /***************************************************************************************
 ** Function name: installExtFirmware
 ** Description:   installs External Firmware using OTA grabbing file information from url
@@ -427,31 +701,40 @@ bool installExtFirmware(String url) {
         return false;
     }
     displayRedStripe("Getting file info");
-    WiFiClientSecure *client = new WiFiClientSecure;
-    client->setInsecure();
-    if (!client) return false;
 
-    HTTPClient http;
-    http.begin(*client, url);
-    http.addHeader("Range", "bytes=32768-33183");          // Get the partition table
-    http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS); // Github links need it
-    http.useHTTP10(true);
-    const char *headerKeys[] = {"Content-Range"};
-    const size_t headerKeysCount = sizeof(headerKeys) / sizeof(headerKeys[0]);
-    http.collectHeaders(headerKeys, headerKeysCount);
-    if (http.GET() != 206) {
-        displayRedStripe("File not found");
-        http.end();
-        return false;
-    }
-    String _fileSize = http.header("Content-Range");
-    _fileSize = _fileSize.substring(_fileSize.lastIndexOf("/") + 1);
-    file_size = _fileSize.toInt();
+    if (url.endsWith(".gz")) {
+        // the table is at 0x8000 of the inflated image, not of the file
+        if (!gzipTableProbe(url, file_size)) {
+            displayRedStripe("File not found");
+            return false;
+        }
+    } else {
+        HTTPClient *http = nullptr;
+        const char *headerKeys[] = {"Content-Range"};
+        const size_t headerKeysCount = sizeof(headerKeys) / sizeof(headerKeys[0]);
+        int httpResponseCode = httpPoolGET(
+            http,
+            url,
+            [](HTTPClient &request) { request.addHeader("Range", "bytes=32768-33183"); }, // Get the partition table
+            headerKeys,
+            headerKeysCount
+        );
+        if (httpResponseCode != 206) {
+            displayRedStripe("File not found");
+            httpPoolEnd(http, false);
+            return false;
+        }
+        String _fileSize = http->header("Content-Range");
+        _fileSize = _fileSize.substring(_fileSize.lastIndexOf("/") + 1);
+        file_size = _fileSize.toInt();
 
-    WiFiClient *stream = http.getStreamPtr();
-    int size_av = stream->available();
-    stream->readBytes(buff, size_av < bufSize ? size_av : bufSize);
-    http.end();
+        // the whole range must be read, or the kept connection would start with its leftovers
+        int range_size = http->getSize();
+        WiFiClient *stream = http->getStreamPtr();
+        size_t got =
+            stream ? stream->readBytes(buff, range_size > 0 && range_size < bufSize ? range_size : bufSize) : 0;
+        httpPoolEnd(http, range_size > 0 && got == (size_t)range_size);
+    }
     // Check if it is a valid partition table
     size_t PartitionSize = 0;
     if (buff[0] == 0xAA) {
@@ -584,11 +867,18 @@ bool clearOnlineCoredump() {
 ***************************************************************************************/
 void installFirmware( // adicionar "fid"
     String fid, String file, uint32_t app_size, bool spiffs, uint32_t spiffs_offset, uint32_t spiffs_size, bool nb,
-    bool fat, uint32_t fat_offset[2], uint32_t fat_size[2]
+    bool fat, uint32_t fat_offset[2], uint32_t fat_size[2], String sha256, String copyPath
 ) {
     uint32_t app_offset = 0x10000;
-    if (!file.startsWith("https://")) file = M5_SERVER_PATH + file;
-    String fileAddr = getHubBaseUrl() + "/download?fid=" + fid + "&file=" + file;
+
+    // catalog digest of the app matches the one in ota_0 and there is no data partition, just start it
+    if (copyPath == "" && !spiffs && !fat && isInstalledApp(sha256)) {
+        displayRedStripe("Already installed");
+        delay(1000);
+        startInstalledApp();
+    }
+    if (!file.startsWith("https://")) file = cdnBase() + file;
+    String fileAddr = hubBase() + "/download?fid=" + fid + "&file=" + file;
     if (fid == "") fileAddr = file;
 
     // Release RAM Memory from Json Objects
@@ -600,6 +890,14 @@ void installFirmware( // adicionar "fid"
         loopOptions(options);
     }
 
+    // sizes from the image table, against the partitions this device has
+    PartitionNeeds needs = {app_size, spiffs ? spiffs_size : 0, 0, 0};
+    if (fat) {
+        needs.fatSys = fat_size[1] ? fat_size[0] : 0;
+        needs.fatVfs = fat_size[1] ? fat_size[1] : fat_size[0];
+    }
+    if (!partitionFitCheck(needs)) return;
+
     if (spiffs && spiffs_size > MAX_SPIFFS) spiffs_size = MAX_SPIFFS;
     if (app_size > MAX_APP) app_size = MAX_APP;
     if (app_size > MAX_APP) app_size = MAX_APP;
@@ -610,6 +908,9 @@ void installFirmware( // adicionar "fid"
 
     tft->fillRect(7, 40, tftWidth - 14, 88, BGCOLOR); // Erase the information below the firmware name
     displayRedStripe("Connecting FW");
+    // installs stream through M5-HTTPUpdate on their own connection, free the pooled ones
+    prefetchEnd();
+    httpPoolClose();
 
     WiFiClient *client = nullptr;
     WiFiClientSecure *secureClient = nullptr;
@@ -628,8 +929,28 @@ void installFirmware( // adicionar "fid"
     progressHandler(0, 500);
     httpUpdate.onProgress(progressHandler);
     httpUpdate.setLedPin(LED, LED_ON);
+    httpUpdate.setSHA256(sha256); // catalog digest, checked while the app is written
     vTaskSuspend(xHandle);
     bool success = false;
+    // compressed images can't be fetched by ranges, the whole stream is inflated once.
+    // Plain ones with data partitions close to the app are also read in one pass, and
+    // so are the ones kept on the SD as they are installed.
+    if (copyPath != "" && !setupSdCard()) {
+        displayRedStripe("SDCard Not Found");
+        delay(1500);
+        copyPath = "";
+    }
+    if (file.endsWith(".gz") || copyPath != "" ||
+        (!nb && useSingleStream(app_size, spiffs, spiffs_offset, spiffs_size, fat, fat_offset, fat_size))) {
+        if (!installStreamFirmware(
+                client, fileAddr, file.endsWith(".gz"), app_size, spiffs, spiffs_offset, spiffs_size, nb, fat,
+                fat_offset, fat_size, sha256, copyPath
+            )) {
+            displayRedStripe("Instalation Failed");
+            goto SAIR;
+        }
+        goto Sucesso;
+    }
     if (nb) success = httpUpdate.update(*client, fileAddr);
     else success = httpUpdate.updateFromOffset(*client, fileAddr, app_offset, app_size);
     if (!client) {
@@ -706,6 +1027,220 @@ SAIR:
     delay(2000);
 }
 
+/***************************************************************************************
+** Function name: streamRegions
+** Description:   partitions written from an image, in the order they are in the stream
+***************************************************************************************/
+static int streamRegions(
+    StreamRegion regions[4], uint32_t app_size, bool spiffs, uint32_t spiffs_offset, uint32_t spiffs_size,
+    bool fat, uint32_t fat_offset[2], uint32_t fat_size[2]
+) {
+    int count = 0;
+    regions[count++] = {0x10000, app_size, "app"};
+    if (spiffs) regions[count++] = {spiffs_offset, spiffs_size, "spiffs"};
+#if !defined(PART_04MB)
+    if (fat) {
+        int FAT = U_FAT_vfs;
+        if (fat_size[1] > 0) FAT = U_FAT_sys;
+        for (int i = 0; i < 2; i++) {
+            if (fat_size[i] > 0)
+                regions[count++] = {fat_offset[i], fat_size[i], (FAT - i * 100) == 400 ? "sys" : "vfs"};
+        }
+    }
+#endif
+    std::sort(regions, regions + count, [](const StreamRegion &a, const StreamRegion &b) {
+        return a.offset < b.offset;
+    });
+    return count;
+}
+
+/***************************************************************************************
+** Function name: useSingleStream
+** Description:   true when reading the image once, gaps included, costs less than a
+**                ranged request per partition
+***************************************************************************************/
+static bool useSingleStream(
+    uint32_t app_size, bool spiffs, uint32_t spiffs_offset, uint32_t spiffs_size, bool fat,
+    uint32_t fat_offset[2], uint32_t fat_size[2]
+) {
+    StreamRegion regions[4];
+    int count = streamRegions(regions, app_size, spiffs, spiffs_offset, spiffs_size, fat, fat_offset, fat_size);
+    if (count < 2) return false; // app only, a single ranged request already
+    uint32_t pos = 0;
+    uint32_t skipped = 0;
+    for (int i = 0; i < count; i++) {
+        if (regions[i].offset > pos) skipped += regions[i].offset - pos;
+        pos = regions[i].offset + regions[i].size;
+    }
+    log_i("Single stream install skips %d bytes", skipped);
+    return skipped <= STREAM_INSTALL_MAX_GAP;
+}
+
+/***************************************************************************************
+** Function name: installDeltaFirmware
+** Description:   installs a version from a delta patch against the app in ota_0
+***************************************************************************************/
+void installDeltaFirmware(String fid, String file) {
+    bool confirmed = false;
+    options = {
+        {"Erase SPIFFS, update", [&]() { confirmed = true; }},
+        {"Cancel",               [&]() { confirmed = false; }},
+    };
+    displayRedStripe("Delta uses SPIFFS space");
+    delay(1500);
+    loopOptions(options);
+    if (!confirmed) return;
+
+    if (!file.startsWith("https://")) file = cdnBase() + file;
+    String fileAddr = hubBase() + "/download?fid=" + fid + "&file=" + file;
+    if (fid == "") fileAddr = file;
+
+    tft->fillRect(7, 40, tftWidth - 14, 88, BGCOLOR); // Erase the information below the firmware name
+    displayRedStripe("Connecting FW");
+    prefetchEnd();
+    httpPoolClose();
+
+    WiFiClient *client = nullptr;
+    if (fileAddr.startsWith("https://")) {
+        WiFiClientSecure *secureClient = new WiFiClientSecure;
+        secureClient->setInsecure();
+        client = secureClient;
+    } else {
+        client = new WiFiClient;
+    }
+    bool success = false;
+    HTTPClient http;
+    http.begin(*client, fileAddr);
+    http.addHeader("HWID", WiFi.macAddress());
+    http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS);
+    http.useHTTP10(true);
+    vTaskSuspend(xHandle);
+    if (http.GET() == HTTP_CODE_OK) {
+        // patches are always gzip compressed
+        GzStream gz(*http.getStreamPtr());
+        tft->fillRoundRect(6, 6, tftWidth - 12, tftHeight - 12, 5, BGCOLOR);
+        if (gz.begin()) success = applyDeltaUpdate(gz);
+        else displayRedStripe("Not enough memory");
+        gz.end();
+    } else displayRedStripe("Couldn't Connect to server");
+    http.end();
+    delete client;
+    if (success) {
+        displayRedStripe("Removing Coredump");
+        clearOnlineCoredump();
+        esp_restart();
+    }
+    vTaskResume(xHandle);
+    delay(2000);
+}
+
+/***************************************************************************************
+** Function name: installStreamFirmware
+** Description:   installs an image from one GET, gzip compressed or not, writing each
+**                partition when the stream reaches its offset and skipping the gaps.
+**                With a copyPath the whole image is also saved there, as downloaded.
+**                The app is checked against sha256 as it is written, when given.
+***************************************************************************************/
+bool installStreamFirmware(
+    WiFiClient *client, String fileAddr, bool gzip, uint32_t app_size, bool spiffs, uint32_t spiffs_offset,
+    uint32_t spiffs_size, bool nb, bool fat, uint32_t fat_offset[2], uint32_t fat_size[2], String sha256,
+    String copyPath
+) {
+    StreamRegion regions[4];
+    int count = 0;
+    bool success = false;
+    HTTPClient http;
+    File copy;
+    TeeStream *tee = nullptr;
+
+    http.begin(*client, fileAddr);
+    http.addHeader("HWID", WiFi.macAddress());
+    http.setFollowRedirects(HTTPC_FORCE_FOLLOW_REDIRECTS); // Github links need it
+    http.useHTTP10(true);
+    if (http.GET() != HTTP_CODE_OK) {
+        http.end();
+        return false;
+    }
+    if (copyPath != "") {
+        String folder = copyPath.substring(0, copyPath.lastIndexOf('/'));
+        if (folder != "" && !SDM.exists(folder)) SDM.mkdir(folder);
+        SDM.remove(copyPath + ".part.json"); // a paused download of the same file is replaced
+        copy = SDM.open(copyPath + ".part", FILE_WRITE);
+        if (copy) tee = new TeeStream(*http.getStreamPtr(), copy);
+        else displayRedStripe("Can't keep a copy");
+    }
+    // the copy is written by the reader from the same buffers the partitions are written from
+    Stream &raw = tee ? (Stream &)*tee : (Stream &)*http.getStreamPtr();
+    GzStream gz(raw);
+    ForwardStream plain(raw);
+    Stream &image = gzip ? (Stream &)gz : (Stream &)plain;
+    auto seekTo = [&](size_t pos) { return gzip ? gz.seek(pos) : plain.seek(pos); };
+    if (gzip && !gz.begin()) {
+        displayRedStripe("Not enough memory");
+        goto Exit;
+    }
+
+    prog_handler = 0;
+    if (nb) {
+        // app only image, its size is the one of the reply when it isn't compressed
+        size_t size = UPDATE_SIZE_UNKNOWN;
+        if (!gzip && http.getSize() > 0) size = http.getSize();
+        success = performUpdate(image, size, U_FLASH, sha256);
+        goto Exit;
+    }
+
+    // the stream only goes forward, so the partitions are written in offset order
+    count = streamRegions(regions, app_size, spiffs, spiffs_offset, spiffs_size, fat, fat_offset, fat_size);
+    for (int i = 0; i < count; i++) {
+        if (!seekTo(regions[i].offset)) {
+            success = false;
+            break;
+        }
+        if (strcmp(regions[i].label, "app") == 0) {
+            prog_handler = 0;
+            success = performUpdate(image, regions[i].size, U_FLASH, sha256);
+            if (!success) break;
+            continue;
+        }
+        prog_handler = 1;
+        if (strcmp(regions[i].label, "spiffs") == 0) {
+            if (!performUpdate(image, regions[i].size, U_SPIFFS)) displayRedStripe("SPIFFS Failed");
+        } else {
+            displayRedStripe("Installing FAT");
+            if (!performFATUpdate(image, regions[i].size, regions[i].label)) displayRedStripe("FAT Failed");
+        }
+    }
+
+Exit:
+    // the gzip CRC covers the SPIFFS and FAT regions too, they have no digest of their own
+    if (success && gzip && !gz.finished()) {
+        displayRedStripe("Image CRC failed");
+        delay(2500);
+        success = false;
+    }
+    gz.end();
+    if (tee) {
+        // what follows the last partition goes to the copy only
+        if (success) {
+            displayRedStripe("Saving copy");
+            while (raw.readBytes((char *)buff, bufSize));
+        }
+        bool copied = success && !tee->failed() && (http.getSize() <= 0 || copy.size() == http.getSize());
+        copy.close();
+        delete tee;
+        if (copied) {
+            SDM.remove(copyPath);
+            SDM.rename(copyPath + ".part", copyPath);
+        } else {
+            SDM.remove(copyPath + ".part");
+            displayRedStripe("Copy not saved");
+            delay(1500);
+        }
+    }
+    http.end();
+    return success;
+}
+
 /***************************************************************************************
 ** Function name: installFAT_OTA
 ** Description:   install FAT partition OverTheAir
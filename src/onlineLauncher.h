@@ -12,15 +12,19 @@ bool installExtFirmware(String url);
 
 void installFirmware(
     String fid, String file, uint32_t app_size, bool spiffs, uint32_t spiffs_offset, uint32_t spiffs_size,
-    bool nb, bool fat, uint32_t fat_offset[2], uint32_t fat_size[2]
+    bool nb, bool fat, uint32_t fat_offset[2], uint32_t fat_size[2], String sha256 = "", String copyPath = ""
 );
 
+void installDeltaFirmware(String fid, String file);
+
 void connectWifi();
 
 void ota_function();
 
 void downloadFirmware(String fid, String file, String fileName, String folder = "/downloads/");
 
+String firmwarePath(String file, String fileName, String folder = "/downloads/");
+
 void wifiConnect(String ssid, int encryptation, bool isAP = false);
 
 bool GetJsonFromEinkHub(
@@ -29,6 +33,16 @@ bool GetJsonFromEinkHub(
 
 JsonDocument getVersionInfo(String fid);
 
+String catalogPath(uint8_t page, String order, bool star, String query);
+
+String versionsPath(String fid);
+
+bool installStreamFirmware(
+    WiFiClient *client, String fileAddr, bool gzip, uint32_t app_size, bool spiffs, uint32_t spiffs_offset,
+    uint32_t spiffs_size, bool nb, bool fat, uint32_t fat_offset[2], uint32_t fat_size[2], String sha256 = "",
+    String copyPath = ""
+);
+
 bool installFAT_OTA(WiFiClient *client, String file, uint32_t offset, uint32_t size, const char *label);
 
 bool clearOnlineCoredump();
@@ -0,0 +1,244 @@
+#include "partitionBackup.h"
+#include "display.h"
+#include <mbedtls/sha256.h>
+
+// Partitions are read a mapping at a time, the MMU page size
+#define BACKUP_BLOCK 0x10000
+
+static_assert(sizeof(BackupHeader) == 64, "backup header layout");
+static_assert(sizeof(BackupExtent) == 12, "backup extent layout");
+
+/***************************************************************************************
+** Function name: sectorFill
+** Description:   true when every byte of the sector is the same, given in value
+***************************************************************************************/
+static bool sectorFill(const uint8_t *data, size_t len, uint8_t &value) {
+    value = data[0];
+    uint32_t word = value * 0x01010101u;
+    const uint32_t *words = (const uint32_t *)data;
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        if (words[i] != word) return false;
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: mappedDigest
+** Description:   SHA-256 of len bytes of a partition from offset, read through mmap
+***************************************************************************************/
+bool mappedDigest(const esp_partition_t *partition, size_t offset, size_t len, uint8_t digest[32]) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    bool ok = true;
+    for (size_t pos = 0; pos < len && ok; pos += BACKUP_BLOCK) {
+        size_t block = len - pos < BACKUP_BLOCK ? len - pos : BACKUP_BLOCK;
+        const void *data;
+        esp_partition_mmap_handle_t handle;
+        ok = esp_partition_mmap(partition, offset + pos, block, ESP_PARTITION_MMAP_DATA, &data, &handle) ==
+             ESP_OK;
+        if (!ok) break;
+        mbedtls_sha256_update(&sha, (const uint8_t *)data, block);
+        esp_partition_munmap(handle);
+    }
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return ok;
+}
+
+static bool writeExtent(File &out, const BackupExtent &extent) {
+    return out.write((const uint8_t *)&extent, sizeof(extent)) == sizeof(extent);
+}
+
+/***************************************************************************************
+** Function name: partitionBackup
+** Description:   writes the sparse backup of a partition, see partitionBackup.h
+***************************************************************************************/
+bool partitionBackup(const esp_partition_t *partition, File &out) {
+    BackupHeader header = {};
+    memcpy(header.magic, BACKUP_MAGIC, sizeof(header.magic));
+    strncpy(header.label, partition->label, sizeof(header.label));
+    header.size = partition->size;
+    if (out.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)) return false;
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    BackupExtent run = {}; // extent being gathered, nothing while its length is 0
+    size_t stored = 0;
+    bool ok = true;
+
+    progressHandler(0, header.size);
+    for (size_t offset = 0; offset < header.size && ok; offset += BACKUP_BLOCK) {
+        size_t block = header.size - offset < BACKUP_BLOCK ? header.size - offset : BACKUP_BLOCK;
+        const uint8_t *data;
+        esp_partition_mmap_handle_t handle;
+        ok = esp_partition_mmap(
+                 partition, offset, block, ESP_PARTITION_MMAP_DATA, (const void **)&data, &handle
+             ) == ESP_OK;
+        if (!ok) break;
+        mbedtls_sha256_update(&sha, data, block);
+
+        for (size_t pos = 0; pos < block && ok; pos += SPI_FLASH_SEC_SIZE) {
+            size_t len = block - pos < SPI_FLASH_SEC_SIZE ? block - pos : SPI_FLASH_SEC_SIZE;
+            uint8_t value = 0;
+            uint8_t kind = sectorFill(data + pos, len, value) ? BACKUP_FILL : BACKUP_DATA;
+            bool erased = kind == BACKUP_FILL && value == 0xFF;
+
+            // a different sector ends the extent, data extents are written from this mapping
+            if (run.length && (erased || kind != run.kind || (kind == BACKUP_FILL && value != run.value))) {
+                ok = writeExtent(out, run);
+                if (ok && run.kind == BACKUP_DATA) {
+                    ok = out.write(data + run.offset - offset, run.length) == run.length;
+                    stored += run.length;
+                }
+                run.length = 0;
+            }
+            if (erased || !ok) continue;
+            if (!run.length) run = {offset + pos, 0, kind, value, 0};
+            run.length += len;
+        }
+        // data extents don't outlive the mapping
+        if (ok && run.length && run.kind == BACKUP_DATA) {
+            ok = writeExtent(out, run) && out.write(data + run.offset - offset, run.length) == run.length;
+            stored += run.length;
+            run.length = 0;
+        }
+        esp_partition_munmap(handle);
+        progressHandler(offset + block, header.size);
+    }
+    if (ok && run.length) ok = writeExtent(out, run);
+    if (ok) ok = writeExtent(out, {0, 0, BACKUP_END, 0, 0});
+
+    mbedtls_sha256_finish(&sha, header.sha256);
+    mbedtls_sha256_free(&sha);
+    if (ok) ok = out.seek(0) && out.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+    log_i("Backup of %s: %u bytes of data out of %u", partition->label, stored, header.size);
+    return ok;
+}
+
+/***************************************************************************************
+** Function name: partitionBackupHeader
+** Description:   reads and checks the header of a backup
+***************************************************************************************/
+bool partitionBackupHeader(File &in, BackupHeader &header) {
+    if (!in.seek(0) || in.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) return false;
+    return memcmp(header.magic, BACKUP_MAGIC, sizeof(header.magic)) == 0;
+}
+
+/***************************************************************************************
+** Function name: eraseGap
+** Description:   erases the sectors from..to of a partition that aren't erased yet
+***************************************************************************************/
+static bool eraseGap(const esp_partition_t *partition, size_t from, size_t to, uint8_t *buf) {
+    size_t run = from; // first sector that needs erasing, to when none
+    for (size_t pos = from; pos <= to; pos += SPI_FLASH_SEC_SIZE) {
+        uint8_t value = 0;
+        bool erased = pos == to;
+        if (!erased) {
+            if (esp_partition_read(partition, pos, buf, SPI_FLASH_SEC_SIZE) != ESP_OK) return false;
+            erased = sectorFill(buf, SPI_FLASH_SEC_SIZE, value) && value == 0xFF;
+        }
+        if (!erased) continue;
+        if (pos > run && esp_partition_erase_range(partition, run, pos - run) != ESP_OK) return false;
+        run = pos + SPI_FLASH_SEC_SIZE;
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: readExtent
+** Description:   next extent of a backup, checked against the previous one
+***************************************************************************************/
+static bool readExtent(File &in, const BackupHeader &header, size_t pos, BackupExtent &extent) {
+    if (in.read((uint8_t *)&extent, sizeof(extent)) != sizeof(extent)) return false;
+    if (extent.kind == BACKUP_END) return true;
+    if (extent.kind != BACKUP_DATA && extent.kind != BACKUP_FILL) return false;
+    return extent.offset >= pos && extent.offset % SPI_FLASH_SEC_SIZE == 0 &&
+           extent.length % SPI_FLASH_SEC_SIZE == 0 && extent.offset + extent.length <= header.size;
+}
+
+/***************************************************************************************
+** Function name: partitionRestore
+** Description:   writes a sparse backup back to a partition and checks its digest
+***************************************************************************************/
+bool partitionRestore(File &in, const esp_partition_t *partition) {
+    BackupHeader header;
+    uint8_t digest[32];
+    if (!partitionBackupHeader(in, header) || header.size > partition->size || header.size % SPI_FLASH_SEC_SIZE)
+        return false;
+    if (strncmp(header.label, partition->label, sizeof(header.label)) != 0)
+        log_i("Restoring a backup of %.16s to %s", header.label, partition->label);
+
+    uint8_t *buf = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (!buf) return false;
+    size_t pos = 0;
+    bool ok = true;
+    progressHandler(0, header.size);
+    while (ok) {
+        BackupExtent extent;
+        ok = readExtent(in, header, pos, extent);
+        if (!ok) break;
+        // sectors left out of the backup were erased
+        ok = eraseGap(partition, pos, extent.kind == BACKUP_END ? header.size : extent.offset, buf);
+        if (!ok || extent.kind == BACKUP_END) break;
+
+        ok = esp_partition_erase_range(partition, extent.offset, extent.length) == ESP_OK;
+        if (extent.kind == BACKUP_FILL) memset(buf, extent.value, SPI_FLASH_SEC_SIZE);
+        for (size_t done = 0; ok && done < extent.length; done += SPI_FLASH_SEC_SIZE) {
+            if (extent.kind == BACKUP_DATA)
+                ok = in.read(buf, SPI_FLASH_SEC_SIZE) == SPI_FLASH_SEC_SIZE;
+            else if (extent.value == 0xFF) continue;
+            ok = ok && esp_partition_write(partition, extent.offset + done, buf, SPI_FLASH_SEC_SIZE) == ESP_OK;
+            progressHandler(extent.offset + done + SPI_FLASH_SEC_SIZE, header.size);
+        }
+        pos = extent.offset + extent.length;
+    }
+    free(buf);
+
+    // what is in flash, not only what was sent to it
+    if (ok) ok = mappedDigest(partition, 0, header.size, digest) && memcmp(digest, header.sha256, 32) == 0;
+    log_i("Restore of %s %s", partition->label, ok ? "verified" : "failed");
+    return ok;
+}
+
+static bool writeFill(Print &out, uint8_t *buf, uint8_t value, size_t len) {
+    memset(buf, value, SPI_FLASH_SEC_SIZE);
+    for (size_t done = 0; done < len; done += SPI_FLASH_SEC_SIZE) {
+        size_t n = len - done < SPI_FLASH_SEC_SIZE ? len - done : SPI_FLASH_SEC_SIZE;
+        if (out.write(buf, n) != n) return false;
+    }
+    return true;
+}
+
+/***************************************************************************************
+** Function name: partitionBackupExpand
+** Description:   writes the raw partition content a backup stands for
+***************************************************************************************/
+bool partitionBackupExpand(File &in, Print &out) {
+    BackupHeader header;
+    if (!partitionBackupHeader(in, header)) return false;
+
+    uint8_t *buf = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+    if (!buf) return false;
+    size_t pos = 0;
+    bool ok = true;
+    while (ok) {
+        BackupExtent extent;
+        ok = readExtent(in, header, pos, extent);
+        if (!ok) break;
+        size_t end = extent.kind == BACKUP_END ? header.size : extent.offset;
+        ok = writeFill(out, buf, 0xFF, end - pos);
+        if (!ok || extent.kind == BACKUP_END) break;
+
+        if (extent.kind == BACKUP_FILL) ok = writeFill(out, buf, extent.value, extent.length);
+        for (size_t done = 0; ok && extent.kind == BACKUP_DATA && done < extent.length;
+             done += SPI_FLASH_SEC_SIZE) {
+            ok = in.read(buf, SPI_FLASH_SEC_SIZE) == SPI_FLASH_SEC_SIZE &&
+                 out.write(buf, SPI_FLASH_SEC_SIZE) == SPI_FLASH_SEC_SIZE;
+        }
+        pos = extent.offset + extent.length;
+    }
+    free(buf);
+    return ok;
+}
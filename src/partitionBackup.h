@@ -0,0 +1,61 @@
+#ifndef __PARTITIONBACKUP_H
+#define __PARTITIONBACKUP_H
+#include <Arduino.h>
+#include <FS.h>
+#include <esp_partition.h>
+
+#define BACKUP_MAGIC "LPB1"
+#define BACKUP_EXTENSION ".bkp"
+
+/*
+  Sparse partition backup, written by dumpPartition and read back by
+  restorePartition and attachPartition:
+
+    header: "LPB1", label (16 bytes), partition size (u32),
+            SHA-256 of the whole partition (32 bytes), reserved (8 bytes)
+    extents, in offset order, sector aligned:
+      offset (u32), length (u32), kind (u8), value (u8), reserved (u16)
+      kind DATA: followed by length bytes
+      kind FILL: every byte is value, nothing follows
+    an extent of kind END
+
+  Erased sectors (0xFF) between extents aren't stored. Numbers are little endian.
+  Sectors of a single repeated byte are kept as fills: deflate needs more RAM
+  than the smaller chips have, and these runs are most of what isn't erased.
+*/
+struct BackupHeader {
+    char magic[4];
+    char label[16];
+    uint32_t size;
+    uint8_t sha256[32];
+    uint32_t reserved[2];
+};
+
+struct BackupExtent {
+    uint32_t offset;
+    uint32_t length;
+    uint8_t kind;
+    uint8_t value;
+    uint16_t reserved;
+};
+
+enum BackupExtentKind : uint8_t { BACKUP_END = 0, BACKUP_DATA = 1, BACKUP_FILL = 2 };
+
+// Writes the backup of partition to out, which must be seekable (the digest is
+// written in the header at the end)
+bool partitionBackup(const esp_partition_t *partition, File &out);
+
+// Reads the header of in, false if it isn't a partition backup
+bool partitionBackupHeader(File &in, BackupHeader &header);
+
+// Writes the backup in back to partition: only the extents and the sectors that
+// must be erased and aren't are touched. Checks the digest afterwards.
+bool partitionRestore(File &in, const esp_partition_t *partition);
+
+// SHA-256 of len bytes of a partition from offset, read through mmap
+bool mappedDigest(const esp_partition_t *partition, size_t offset, size_t len, uint8_t digest[32]);
+
+// Writes the whole content of the backup in, erased sectors included, to out
+bool partitionBackupExpand(File &in, Print &out);
+
+#endif
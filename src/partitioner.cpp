@@ -1,8 +1,14 @@
 #include "partitioner.h"
 #include "display.h"
 #include "esp_heap_caps.h"
+#include "esp_image_format.h"
+#include "esp_flash_partitions.h"
 #include "mykeyboard.h"
+#include "partitionBackup.h"
 #include "sd_functions.h"
+#include "settings.h"
+#include "trace.h"
+#include <MD5Builder.h>
 #include <globals.h>
 
 // Define o tamanho da partição
@@ -230,6 +236,129 @@ Exit:
     Serial.print("Desistiu");
 }
 
+/***************************************************************************************
+** Function name: partitionTableFor
+** Description:   builds a table keeping everything up to the Launcher partition and
+**                laying out ota_0 and the data partitions after it, see partitioner.h
+***************************************************************************************/
+size_t partitionTableFor(const PartitionNeeds &needs, uint8_t *table) {
+    const esp_partition_t *launcher = esp_ota_get_running_partition();
+    esp_partition_info_t *entries = (esp_partition_info_t *)table;
+    const int maxEntries = ESP_PARTITION_TABLE_MAX_LEN / sizeof(esp_partition_info_t) - 1; // md5 entry
+    uint32_t flashSize = 0;
+    uint32_t coredump = PART_COREDUMP_SIZE;
+    char appLabel[16] = "app0";
+    int count = 0;
+
+    // the Launcher can't move while it runs
+    if (!launcher || launcher->subtype != TARGET_PARTITION) return 0;
+    if (esp_flash_get_size(NULL, &flashSize) != ESP_OK) return 0;
+    if (esp_flash_read(NULL, table, ESP_PARTITION_TABLE_OFFSET, ESP_PARTITION_TABLE_MAX_LEN) != ESP_OK) return 0;
+
+    uint32_t launcherEnd = launcher->address + launcher->size;
+    for (int i = 0; i < maxEntries && entries[i].magic == ESP_PARTITION_MAGIC; i++) {
+        esp_partition_info_t entry = entries[i];
+        if (entry.pos.offset < launcherEnd) {
+            if (strncmp((const char *)entry.label, appLabel, sizeof(entry.label)) == 0) strcpy(appLabel, "app1");
+            entries[count++] = entry;
+        } else if (entry.type == ESP_PARTITION_TYPE_DATA && entry.subtype == ESP_PARTITION_SUBTYPE_DATA_COREDUMP) {
+            coredump = entry.pos.size;
+        }
+    }
+    if (count + 5 > maxEntries) return 0;
+
+    // data partitions keep the size of their images: FAT and SPIFFS read theirs from the partition size
+    uint32_t pos = (launcherEnd + SPI_FLASH_BLOCK_SIZE - 1) & ~(SPI_FLASH_BLOCK_SIZE - 1);
+    uint32_t sys = (needs.fatSys + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    uint32_t vfs = (needs.fatVfs + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    uint32_t spiffs = (needs.spiffs + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    if (flashSize < pos + sys + vfs + spiffs + coredump) return 0;
+    // the app takes the rest, what its alignment leaves goes to the coredump
+    uint32_t app = (flashSize - pos - sys - vfs - spiffs - coredump) & ~(SPI_FLASH_BLOCK_SIZE - 1);
+    if (!app || app < needs.app) return 0;
+
+    auto add = [&](const char *label, uint8_t type, uint8_t subtype, uint32_t size) {
+        if (!size) return;
+        esp_partition_info_t &entry = entries[count++];
+        memset(&entry, 0, sizeof(entry));
+        entry.magic = ESP_PARTITION_MAGIC;
+        entry.type = type;
+        entry.subtype = subtype;
+        entry.pos = {pos, size};
+        strncpy((char *)entry.label, label, sizeof(entry.label));
+        pos += size;
+    };
+    add(appLabel, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, app);
+    add("sys", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, sys);
+    add("vfs", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, vfs);
+    add("spiffs", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, spiffs);
+    add("coredump", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, flashSize - pos);
+
+    // md5 entry: magic, 14 bytes of 0xFF and the MD5 of the entries before it
+    size_t len = count * sizeof(esp_partition_info_t);
+    memset(table + len, 0xFF, ESP_PARTITION_TABLE_MAX_LEN - len);
+    table[len] = table[len + 1] = 0xEB;
+    MD5Builder md5;
+    md5.begin();
+    md5.add(table, len);
+    md5.calculate();
+    md5.getBytes(table + len + 16);
+    return len + sizeof(esp_partition_info_t);
+}
+
+/***************************************************************************************
+** Function name: partitionFitCheck
+** Description:   offers to repartition when the image doesn't fit the current table
+***************************************************************************************/
+bool partitionFitCheck(const PartitionNeeds &needs) {
+    if (needs.app <= MAX_APP && needs.spiffs <= MAX_SPIFFS && needs.fatSys <= MAX_FAT_sys &&
+        needs.fatVfs <= MAX_FAT_vfs)
+        return true;
+    log_i(
+        "Image needs app %u, spiffs %u, sys %u, vfs %u", needs.app, needs.spiffs, needs.fatSys, needs.fatVfs
+    );
+
+    uint8_t *table = (uint8_t *)heap_caps_malloc(ESP_PARTITION_TABLE_MAX_LEN, MALLOC_CAP_INTERNAL);
+    size_t len = table ? partitionTableFor(needs, table) : 0;
+    if (!len) {
+        // the image gets cut to the partitions, as before
+        heap_caps_free(table);
+        displayRedStripe("Too big for this flash");
+        delay(2000);
+        return true;
+    }
+
+    int choice = 0;
+    options = {
+        {"Repartition",    [&]() { choice = 1; }},
+        {"Install anyway", [&]() { choice = 2; }},
+        {"Cancel",         [&]() { choice = 0; }},
+    };
+    displayRedStripe("Partitions too small");
+    delay(1500);
+    loopOptions(options);
+    if (choice != 1) {
+        heap_caps_free(table);
+        return choice == 2;
+    }
+
+    bool ok = partitionSetter(table, len);
+    heap_caps_free(table);
+    if (!ok) {
+        displayRedStripe("Partitioning Error");
+        delay(2000);
+        return false;
+    }
+    // the running app keeps the table it booted with
+    displayRedStripe("Restart, then install again");
+    while (!check(SelPress)) yield();
+    while (check(SelPress)) yield();
+    stayInLauncher();
+    FREE_TFT
+    ESP.restart();
+    return false;
+}
+
 void partList() {
     // Obtemos a lista de partições
     const esp_partition_t *partition;
@@ -282,11 +411,11 @@ void dumpPartition(const char *partitionLabel, const char *outputPath) {
     if (!SDM.exists("/bkp")) SDM.mkdir("/bkp");
 
     String output = outputPath;
-    output += ".bin";
+    output += BACKUP_EXTENSION;
     int i = 0;
     while (SDM.exists(output)) {
         i++;
-        output = String(outputPath) + String(i) + ".bin";
+        output = String(outputPath) + String(i) + BACKUP_EXTENSION;
     }
 
     File outputFile = SDM.open(output.c_str(), FILE_WRITE, true);
@@ -297,27 +426,16 @@ void dumpPartition(const char *partitionLabel, const char *outputPath) {
 
     Serial.printf("Iniciando dump da partição %s para o arquivo %s\n", partitionLabel, outputPath);
 
-    const size_t bufferSize = 1024; // Ajuste conforme necessário
-    uint8_t buffer[1024];
-    size_t bytesToRead = 0;
-    esp_err_t result;
+    // only what isn't erased is stored, see partitionBackup.h
     progressHandler(0, 500);
     displayRedStripe("Backing up");
-    for (size_t offset = 0; offset < partition->size; offset += bufferSize) {
-        bytesToRead = (offset + bufferSize > partition->size) ? (partition->size - offset) : bufferSize;
-        result = esp_partition_read(partition, offset, buffer, bytesToRead);
-        if (result != ESP_OK) {
-            Serial.printf(
-                "Erro ao ler a partição %s no offset %d (código de erro: %d)\n",
-                partitionLabel,
-                offset,
-                result
-            );
-            outputFile.close();
-            return;
-        }
-        outputFile.write(buffer, bytesToRead);
-        progressHandler(int(offset + bufferSize), partition->size);
+    if (!partitionBackup(partition, outputFile)) {
+        Serial.printf("Erro ao ler a partição %s\n", partitionLabel);
+        outputFile.close();
+        SDM.remove(output);
+        displayRedStripe("Backup failed");
+        delay(2500);
+        return;
     }
     outputFile.close();
     displayRedStripe("    Complete!    ");
@@ -343,24 +461,27 @@ void restorePartition(const char *partitionLabel) {
     if (filepath == "") return;
     else {
         File source = SDM.open(filepath, "r");
-        if (strcmp(partitionLabel, "spiffs") == 0) {
-            prog_handler = 1;
-            Update.begin(source.size(), U_SPIFFS);
-            uint8_t buffer[1024];
-            int bytesRead = 0;
-            int written = 0;
-            size_t total = source.size();
+        BackupHeader header;
+        if (partitionBackupHeader(source, header)) {
+            // sparse backup, written straight to the partition and verified
+            const esp_partition_t *partition =
+                esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel);
             progressHandler(0, 500);
-            while (source.available()) {
-                bytesRead = source.read(buffer, sizeof(buffer));
-                Update.write(buffer, bytesRead);
-                written += bytesRead;
-                progressHandler(written, total);
+            displayRedStripe("Restoring");
+            bool restored = partition && partitionRestore(source, partition);
+            source.close();
+            if (!restored) {
+                displayRedStripe("Restore failed");
+                delay(2500);
+                return;
             }
-        }
+        } else {
+            source.seek(0);
+            if (strcmp(partitionLabel, "spiffs") == 0) { performUpdate(source, source.size(), U_SPIFFS); }
 
-        if (strcmp(partitionLabel, "vfs") == 0) { performFATUpdate(source, source.size(), "vfs"); }
-        if (strcmp(partitionLabel, "sys") == 0) { performFATUpdate(source, source.size(), "sys"); }
+            if (strcmp(partitionLabel, "vfs") == 0) { performFATUpdate(source, source.size(), "vfs"); }
+            if (strcmp(partitionLabel, "sys") == 0) { performFATUpdate(source, source.size(), "sys"); }
+        }
     }
     delay(100);
     displayRedStripe("    Restored!    ");
@@ -368,41 +489,118 @@ void restorePartition(const char *partitionLabel) {
 }
 
 #define TAG "Partitioneer"
-#define BUFFER_SIZE 1024
+#define COPY_BLOCK_SIZE 0x10000 // flash erase block, and MMU page
+
+/***************************************************************************************
+** Function name: appImageLength
+** Description:   length of the app image at offset in a partition, from the
+**                segment headers, 0 if there isn't one
+***************************************************************************************/
+size_t appImageLength(const esp_partition_t *part, size_t offset) {
+    esp_image_header_t header;
+    esp_image_segment_header_t segment;
+    if (esp_partition_read(part, offset, &header, sizeof(header)) != ESP_OK) return 0;
+    if (header.magic != ESP_IMAGE_HEADER_MAGIC || header.segment_count > ESP_IMAGE_MAX_SEGMENTS) return 0;
+
+    size_t length = sizeof(header);
+    for (int i = 0; i < header.segment_count; i++) {
+        if (esp_partition_read(part, offset + length, &segment, sizeof(segment)) != ESP_OK) return 0;
+        length += sizeof(segment) + segment.data_len;
+        if (offset + length > part->size) return 0;
+    }
+    length = (length + 1 + 15) & ~15; // checksum byte, padded to 16
+    if (header.hash_appended == 1) length += 32;
+    return length;
+}
 
-// Função para copiar partições com buffer de 1024 bytes
-esp_err_t copy_partition(const esp_partition_t *src, const esp_partition_t *dst) {
-    uint8_t buffer[BUFFER_SIZE];
-    esp_err_t err;
-    progressHandler(0, 500);
-    displayRedStripe("Launcher Update");
-    for (size_t offset = 0; offset < dst->size; offset += BUFFER_SIZE) {
-        size_t read_size = BUFFER_SIZE;
-        if (offset + BUFFER_SIZE > dst->size) { read_size = dst->size - offset; }
+static bool isErased(const uint8_t *data, size_t len) {
+    const uint32_t *word = (const uint32_t *)data;
+    for (size_t i = 0; i < len / sizeof(uint32_t); i++) {
+        if (word[i] != 0xFFFFFFFF) return false;
+    }
+    return true;
+}
 
-        err = esp_partition_read(src, offset, buffer, read_size);
+/***************************************************************************************
+** Function name: copy_region
+** Description:   copies length bytes from src to dst, 64Kb at a time: each block of
+**                src is mapped, the one of dst erased and only the sectors with
+**                data written, straight from the mapping. dstOffset is sector aligned
+***************************************************************************************/
+esp_err_t copy_region(
+    const esp_partition_t *src, size_t srcOffset, const esp_partition_t *dst, size_t dstOffset, size_t length
+) {
+    esp_err_t err = ESP_OK;
+    if (srcOffset + length > src->size || dstOffset + length > dst->size) return ESP_ERR_INVALID_SIZE;
+
+    progressHandler(0, length);
+    for (size_t offset = 0; offset < length; offset += COPY_BLOCK_SIZE) {
+        size_t block = length - offset < COPY_BLOCK_SIZE ? length - offset : COPY_BLOCK_SIZE;
+        const uint8_t *data;
+        esp_partition_mmap_handle_t handle;
+        err = esp_partition_mmap(
+            src, srcOffset + offset, block, ESP_PARTITION_MMAP_DATA, (const void **)&data, &handle
+        );
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to read source partition at offset %u", offset);
+            ESP_LOGE(TAG, "Failed to map source partition at offset %u", srcOffset + offset);
             return err;
         }
 
-        err = esp_partition_write(dst, offset, buffer, read_size);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write to destination partition at offset %u", offset);
-            return err;
+        err = esp_partition_erase_range(
+            dst, dstOffset + offset, (block + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1)
+        );
+        if (err != ESP_OK)
+            ESP_LOGE(TAG, "Failed to erase destination partition at offset %u", dstOffset + offset);
+
+        // erased sectors of the source are left as the erase made them, the others
+        // are written in runs as long as possible
+        size_t run = 0;
+        size_t pos = 0;
+        while (err == ESP_OK) {
+            size_t len = block - pos < SPI_FLASH_SEC_SIZE ? block - pos : SPI_FLASH_SEC_SIZE;
+            if (len && !isErased(data + pos, len)) {
+                pos += len;
+                continue;
+            }
+            if (pos > run) {
+                err = esp_partition_write(dst, dstOffset + offset + run, data + run, pos - run);
+                if (err != ESP_OK)
+                    ESP_LOGE(
+                        TAG, "Failed to write to destination partition at offset %u", dstOffset + offset + run
+                    );
+            }
+            if (!len) break;
+            pos += len;
+            run = pos;
         }
-        progressHandler(offset + BUFFER_SIZE, dst->size);
+        esp_partition_munmap(handle);
+        if (err != ESP_OK) return err;
+        progressHandler(offset + block, length);
     }
 
     return ESP_OK;
 }
-#if CONFIG_IDF_TARGET_ESP32P4
-#define TARGET_PARTITION ESP_PARTITION_SUBTYPE_APP_FACTORY
-#else
-#define TARGET_PARTITION ESP_PARTITION_SUBTYPE_APP_TEST
-#endif
+
+/***************************************************************************************
+** Function name: copy_partition
+** Description:   copies the app image of src over dst, only its length
+***************************************************************************************/
+esp_err_t copy_partition(const esp_partition_t *src, const esp_partition_t *dst) {
+    size_t length = appImageLength(src);
+    if (length == 0) length = src->size < dst->size ? src->size : dst->size; // not an image, copy it all
+    if (length > dst->size) {
+        ESP_LOGE(TAG, "Image of %u bytes doesn't fit the destination partition", length);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ESP_LOGI(TAG, "Copying %u bytes", length);
+
+    progressHandler(0, 500);
+    displayRedStripe("Launcher Update");
+    return copy_region(src, 0, dst, 0, length);
+}
 // Função principal
 void partitionCrawler() {
+    TRACE_SPAN("partitionCrawler");
     const esp_partition_t *running_partition = esp_ota_get_running_partition();
     if (running_partition == NULL) {
         ESP_LOGE(TAG, "Failed to get running partition");
@@ -428,15 +626,9 @@ void partitionCrawler() {
         return;
     }
 
-    ESP_LOGI(TAG, "Erasing test partition");
-    esp_err_t err = esp_partition_erase_range(test_partition, 0, test_partition->size);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to erase test partition");
-        return;
-    }
-
+    // copy_partition erases what it writes, the rest of the test partition isn't used
     ESP_LOGI(TAG, "Copying running partition to test partition");
-    err = copy_partition(running_partition, test_partition);
+    esp_err_t err = copy_partition(running_partition, test_partition);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to copy partition data");
         displayRedStripe("Use M5Burner!");
@@ -539,12 +731,26 @@ bool attachPartition(String _from, String _to) {
     }
 
     target.seek(offset);
-    while (true) {
-        int angle = (360 * (target.position() - offset)) / from.size();
-        tft->drawArc(tftWidth / 2, tftHeight / 2, 35, 30, 0, angle, ALCOLOR);
-        size_t bytesRead = from.read(buff, sizeof(buff));
-        if (!bytesRead) break;
-        target.write(buff, bytesRead);
+    BackupHeader header;
+    if (partitionBackupHeader(from, header)) {
+        // sparse backup, expanded to the whole partition
+        displayRedStripe("Expanding backup");
+        if (!partitionBackupExpand(from, target)) {
+            displayRedStripe("Invalid backup");
+            delay(2500);
+            from.close();
+            target.close();
+            return false;
+        }
+    } else {
+        from.seek(0);
+        while (true) {
+            int angle = (360 * (target.position() - offset)) / from.size();
+            tft->drawArc(tftWidth / 2, tftHeight / 2, 35, 30, 0, angle, ALCOLOR);
+            size_t bytesRead = from.read(buff, sizeof(buff));
+            if (!bytesRead) break;
+            target.write(buff, bytesRead);
+        }
     }
 
     from.close();
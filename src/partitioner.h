@@ -18,6 +18,42 @@ bool attachPartition(String from, String to);
 
 void partitionCrawler();
 
+// Partition the Launcher runs from, once partitionCrawler has put it in place
+#if CONFIG_IDF_TARGET_ESP32P4
+#define TARGET_PARTITION ESP_PARTITION_SUBTYPE_APP_FACTORY
+#else
+#define TARGET_PARTITION ESP_PARTITION_SUBTYPE_APP_TEST
+#endif
+
+size_t appImageLength(const esp_partition_t *part, size_t offset = 0);
+
+esp_err_t copy_region(
+    const esp_partition_t *src, size_t srcOffset, const esp_partition_t *dst, size_t dstOffset, size_t length
+);
+
+// Coredump size when the current table has none
+#ifndef PART_COREDUMP_SIZE
+#define PART_COREDUMP_SIZE 0x10000
+#endif
+
+// Partition sizes an image asks for in its own table (0x8000), 0 when it has none
+struct PartitionNeeds {
+    uint32_t app;
+    uint32_t spiffs;
+    uint32_t fatSys;
+    uint32_t fatVfs;
+};
+
+// Builds a partition table, MD5 entry included, in table (ESP_PARTITION_TABLE_MAX_LEN
+// bytes): the entries up to the Launcher partition are kept, then ota_0 takes all the
+// flash the data partitions of needs and the coredump leave. Returns its length, 0
+// when needs don't fit the flash.
+size_t partitionTableFor(const PartitionNeeds &needs, uint8_t *table);
+
+// When needs don't fit the current partitions, asks to repartition (and restarts),
+// install anyway or cancel. False when the install should not go on.
+bool partitionFitCheck(const PartitionNeeds &needs);
+
 #if defined(HEADLESS)
 const uint8_t def_part[192] PROGMEM = {
     // 4Mb app partition
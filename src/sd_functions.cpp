@@ -1,7 +1,13 @@
 #include "sd_functions.h"
 #include "display.h"
+#include "fwIndex.h"
+#include "gzStream.h"
+#include "installPipeline.h"
 #include "esp_log.h"
 #include "mykeyboard.h"
+#include "partitionBackup.h"
+#include "partitioner.h"
+#include "trace.h"
 #include <algorithm> // for std::sort
 #include <esp_flash.h>
 #include <esp_ota_ops.h>
@@ -289,11 +295,15 @@ void readFs(String &folder, std::vector<Option> &opt) {
         return; // Retornar imediatamente se não for possível abrir o diretório
     }
 
+    fwIndexBeginListing(folder);
     while (true) {
-        bool isDir;
-        String fullPath = root.getNextFileName(&isDir);
+        // the entry is opened once, and handed to the index as it is
+        File entry = root.openNextFile();
+        if (!entry) { break; }
+        bool isDir = entry.isDirectory();
+        String fullPath = entry.path();
         String nameOnly = fullPath.substring(fullPath.lastIndexOf("/") + 1);
-        if (fullPath == "") { break; }
+        if (nameOnly == FW_INDEX_FILE) continue;
         // Serial.printf("Path: %s (isDir: %d)\n", fullPath.c_str(), isDir);
 
         uint16_t color = FGCOLOR - 0x1111;
@@ -302,14 +312,24 @@ void readFs(String &folder, std::vector<Option> &opt) {
             int dotIndex = nameOnly.lastIndexOf(".");
             String ext = dotIndex >= 0 ? nameOnly.substring(dotIndex + 1) : "";
             ext.toUpperCase();
-            if (onlyBins && !ext.equals("BIN")) { continue; }
+            // partition backups stay visible so restore and attach can pick them
+            if (onlyBins && !ext.equals("BIN") && !nameOnly.endsWith(".bin.gz") &&
+                !nameOnly.endsWith(BACKUP_EXTENSION)) {
+                continue;
+            }
             color = FGCOLOR;
+            if (isFirmwareFile(nameOnly)) {
+                // layout comes from the folder index, the image is only parsed when it changed
+                FirmwareLayout layout;
+                if (fwIndexGet(entry, layout)) nameOnly += " " + fwIndexDescribe(layout);
+            }
         } else {
             nameOnly = "/" + nameOnly; // add / before folder name
         }
         opt.push_back({nameOnly, [fullPath]() { fileToUse = fullPath; }, color});
     }
     root.close();
+    fwIndexEndListing();
     std::sort(opt.begin(), opt.end(), sortList);
     opt.push_back({"> Back", [&]() { fileToUse = ""; }, ALCOLOR});
 }
@@ -414,7 +434,7 @@ RESTART:
         std::vector<Option> opt = {
             {"Install",    [=]() { updateFromSD(fileToUse); }                    },
             {"New Folder", [=]() { createFolder(Folder); }                       },
-            {"Rename",     [=]() { renameFile(fileToUse, options[index].label); }},
+            {"Rename",     [=]() { renameFile(fileToUse, fileToUse.substring(fileToUse.lastIndexOf('/') + 1)); }},
             {"Copy",       [=]() { copyFile(fileToUse); }                        },
         };
         if (fileToCopy != "") opt.push_back({"Paste", [=]() { pasteFile(Folder); }});
@@ -432,9 +452,12 @@ RESTART:
 
 /***************************************************************************************
 ** Function name: performUpdate
-** Description:   this function performs the update
+** Description:   this function performs the update, app images are checked
+**                against sha256 (when known) and their appended digest as written
 ***************************************************************************************/
-void performUpdate(Stream &updateSource, size_t updateSize, int command) {
+bool performUpdate(Stream &updateSource, size_t updateSize, int command, const String &sha256) {
+    TRACE_SPAN("performUpdate");
+    bool success = false;
     // command = U_FAT_vfs = 300
     // command = U_FAT_sys = 400
     // command = U_SPIFFS = 100
@@ -445,21 +468,25 @@ void performUpdate(Stream &updateSource, size_t updateSize, int command) {
 
     vTaskSuspend(xHandle);
     if (Update.begin(updateSize, command)) {
-        int written = 0;
-        uint8_t buf[1024];
-        int bytesRead;
+        size_t written = 0;
+        if (command == U_FLASH && sha256 != "") Update.setSHA256(sha256.c_str());
+        // unknown size (compressed sources): install until the source ends
+        size_t total = updateSize == UPDATE_SIZE_UNKNOWN ? Update.size() : updateSize;
 
         prog_handler = 0; // Install flash update
         if (command == U_SPIFFS || command == U_FAT_vfs || command == U_FAT_sys)
             prog_handler = 1; // Install flash update
         log_i("updateSize = %d", updateSize);
-        while (written < updateSize) { // updateSource.available() > 0 &&
-            bytesRead = updateSource.readBytes(buf, sizeof(buf));
-            written += Update.write(buf, bytesRead);
-            progressHandler(written, updateSize);
-        }
-        if (Update.end()) {
+        // SD reads run in the pipeline reader task while this one erases and writes the flash
+        pipelineTransfer(updateSource, total, [&](uint8_t *data, size_t len) {
+            size_t w = Update.write(data, len);
+            written += w;
+            progressHandler(written, total);
+            return w == len;
+        });
+        if (Update.end(updateSize == UPDATE_SIZE_UNKNOWN)) {
             if (Update.isFinished()) {
+                success = true;
                 log_i("Update successfully completed. Rebooting.");
                 displayRedStripe("Removing coredump (if any)...");
                 clearCoredump();
@@ -467,6 +494,10 @@ void performUpdate(Stream &updateSource, size_t updateSize, int command) {
             else log_i("Update not finished? Something went wrong!");
         } else {
             log_i("Error Occurred. Error #: %s", String(Update.getError()));
+            if (Update.getError() == UPDATE_ERROR_SHA256) {
+                displayRedStripe("Image check failed");
+                delay(2500);
+            }
         }
     } else {
         uint8_t error = Update.getError();
@@ -474,9 +505,25 @@ void performUpdate(Stream &updateSource, size_t updateSize, int command) {
         delay(2500);
     }
     vTaskResume(xHandle);
+    return success;
 }
 
 
+/***************************************************************************************
+** Function name: startInstalledApp
+** Description:   restarts into the app in ota_0, the P4 has to be told to boot it
+***************************************************************************************/
+void startInstalledApp() {
+    FREE_TFT
+#if CONFIG_IDF_TARGET_ESP32P4
+    const esp_partition_t *partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    esp_ota_set_boot_partition(partition);
+    ESP.deepSleep(100);
+#endif
+    ESP.restart();
+}
+
 /***************************************************************************************
  ** Function name: clearCoredump
  ** Description:   As some programs may generate core dumps,
@@ -512,7 +559,7 @@ bool clearCoredump() {
 ** Description:   this function analyse the .bin and calls performUpdate
 ***************************************************************************************/
 void updateFromSD(String path) {
-    uint8_t firstThreeBytes[16];
+    FirmwareLayout layout;
     uint32_t spiffs_offset = 0;
     uint32_t spiffs_size = 0;
     uint32_t app_size = 0;
@@ -524,72 +571,91 @@ void updateFromSD(String path) {
     bool fat = false;
 
     File file = SDM.open(path);
+    // .bin.gz images are inflated on the fly, offsets below refer to the inflated image
+    GzStream gz(file, [&]() { return file.seek(0); });
+    Stream *source = &file;
+    size_t image_size = 0;
+    auto seekTo = [&](size_t pos) { return layout.compressed ? gz.seek(pos) : file.seek(pos); };
 
     if (!file) goto Exit;
-    if (!file.seek(0x8000)) goto Exit;
-    file.read(firstThreeBytes, 16);
+    // partition table of the image, cached in the folder index
+    if (!fwIndexLookup(path, layout)) goto Exit;
+    image_size = layout.imageSize;
+
+    // same app already in ota_0 and no data partitions to write, nothing to flash
+    if (!fwIndexHasData(layout)) {
+        if (layout.sha256 == "") displayRedStripe("Checking image");
+        if (isInstalledApp(fwIndexAppDigest(path, layout))) {
+            displayRedStripe("Already installed");
+            delay(1000);
+            file.close();
+            startInstalledApp();
+        }
+    }
+    if (layout.compressed) {
+        if (!file.seek(0) || !gz.begin()) {
+            displayRedStripe("Not enough memory");
+            delay(2500);
+            file.close();
+            return;
+        }
+        source = &gz;
+    }
 
-    if (firstThreeBytes[0] != 0xAA || firstThreeBytes[1] != 0x50 || firstThreeBytes[2] != 0x01) {
-        if (!file.seek(0x0)) goto Exit;
-        performUpdate(file, file.size(), U_FLASH);
+    if (!layout.hasTable) {
+        if (!seekTo(0x0)) goto Exit;
+        performUpdate(*source, image_size, U_FLASH, layout.sha256);
+        if (layout.compressed && !gz.finished()) goto GzFail;
         file.close();
         tft->fillScreen(BGCOLOR);
-        FREE_TFT
-#if CONFIG_IDF_TARGET_ESP32P4
-        const esp_partition_t *partition =
-            esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-        esp_ota_set_boot_partition(partition);
-        ESP.deepSleep(100);
-#endif
-        ESP.restart();
+        startInstalledApp();
     } else {
-        if (!file.seek(0x8000)) goto Exit;
-        for (int i = 0; i < 0x0A0; i += 0x20) {
-            if (!file.seek(0x8000 + i)) goto Exit;
-            file.read(firstThreeBytes, 16);
-
-            if ((firstThreeBytes[0x03] == 0x00 || firstThreeBytes[0x03] == 0x10 ||
-                 firstThreeBytes[0x03] == 0x20) &&
-                firstThreeBytes[0x06] == 0x01) {
-                app_size = (firstThreeBytes[0x0A] << 16) | (firstThreeBytes[0x0B] << 8) | 0x00;
-                if (file.size() < (app_size + 0x10000)) app_size = file.size() - 0x10000;
-                else if (app_size > MAX_APP) app_size = MAX_APP;
-            }
+        // what the image holds, against the partitions this device has
+        PartitionNeeds needs = {
+            image_size > 0x10000 ? std::min<uint32_t>(layout.appSize, image_size - 0x10000) : 0,
+            image_size > layout.spiffsOffset ? layout.spiffsSize : 0,
+            image_size > layout.fatSysOffset ? layout.fatSysSize : 0,
+            image_size > layout.fatVfsOffset ? layout.fatVfsSize : 0,
+        };
+        if (!partitionFitCheck(needs)) {
+            file.close();
+            tft->fillScreen(BGCOLOR);
+            return;
+        }
 
-            if (firstThreeBytes[3] == 0x82) {
-                spiffs_offset =
-                    (firstThreeBytes[0x06] << 16) | (firstThreeBytes[0x07] << 8) | firstThreeBytes[0x08];
-                spiffs_size = (firstThreeBytes[0x0A] << 16) | (firstThreeBytes[0x0B] << 8) | 0x00;
-                if (file.size() < spiffs_offset) spiffs = false;
-                else if (spiffs_size > MAX_SPIFFS) {
-                    spiffs_size = MAX_SPIFFS;
-                    spiffs = true;
-                }
-                if (spiffs && file.size() < (spiffs_offset + spiffs_size))
-                    spiffs_size = file.size() - spiffs_offset;
-            }
+        if (layout.appSize) {
+            app_size = layout.appSize;
+            if (image_size < (app_size + 0x10000)) app_size = image_size - 0x10000;
+            else if (app_size > MAX_APP) app_size = MAX_APP;
+        }
 
-            if (firstThreeBytes[3] == 0x81 && firstThreeBytes[0x0C] == 0x73) {
-                fat_offset_sys =
-                    (firstThreeBytes[0x06] << 16) | (firstThreeBytes[0x07] << 8) | firstThreeBytes[0x08];
-                fat_size_sys = (firstThreeBytes[0x0A] << 16) | (firstThreeBytes[0x0B] << 8) | 0x00;
-                if (file.size() < fat_offset_sys) fat = false;
-                else fat = true;
-                if (fat && fat_size_sys > MAX_FAT_sys) fat_size_sys = MAX_FAT_sys;
-                if (fat && file.size() < (fat_offset_sys + fat_size_sys))
-                    fat_size_sys = file.size() - fat_offset_sys;
+        if (layout.spiffsSize) {
+            spiffs_offset = layout.spiffsOffset;
+            spiffs_size = layout.spiffsSize;
+            if (image_size < spiffs_offset) spiffs = false;
+            else if (spiffs_size > MAX_SPIFFS) {
+                spiffs_size = MAX_SPIFFS;
+                spiffs = true;
             }
+            if (spiffs && image_size < (spiffs_offset + spiffs_size)) spiffs_size = image_size - spiffs_offset;
+        }
 
-            if (firstThreeBytes[3] == 0x81 && firstThreeBytes[0x0C] == 0x76) {
-                fat_offset_vfs =
-                    (firstThreeBytes[0x06] << 16) | (firstThreeBytes[0x07] << 8) | firstThreeBytes[0x08];
-                fat_size_vfs = (firstThreeBytes[0x0A] << 16) | (firstThreeBytes[0x0B] << 8) | 0x00;
-                if (file.size() < fat_offset_vfs) fat = false;
-                else fat = true;
-                if (fat && fat_size_vfs > MAX_FAT_vfs) fat_size_vfs = MAX_FAT_vfs;
-                if (fat && file.size() < (fat_offset_vfs + fat_size_vfs))
-                    fat_size_vfs = file.size() - fat_offset_vfs;
-            }
+        if (layout.fatSysSize) {
+            fat_offset_sys = layout.fatSysOffset;
+            fat_size_sys = layout.fatSysSize;
+            if (image_size < fat_offset_sys) fat = false;
+            else fat = true;
+            if (fat && fat_size_sys > MAX_FAT_sys) fat_size_sys = MAX_FAT_sys;
+            if (fat && image_size < (fat_offset_sys + fat_size_sys)) fat_size_sys = image_size - fat_offset_sys;
+        }
+
+        if (layout.fatVfsSize) {
+            fat_offset_vfs = layout.fatVfsOffset;
+            fat_size_vfs = layout.fatVfsSize;
+            if (image_size < fat_offset_vfs) fat = false;
+            else fat = true;
+            if (fat && fat_size_vfs > MAX_FAT_vfs) fat_size_vfs = MAX_FAT_vfs;
+            if (fat && image_size < (fat_offset_vfs + fat_size_vfs)) fat_size_vfs = image_size - fat_offset_vfs;
         }
 
         // log_i("Appsize: %d", app_size);
@@ -626,40 +692,38 @@ void updateFromSD(String path) {
         log_i("FATsize[0]: %d - max: %d at offset: %d", fat_size_sys, MAX_FAT_sys, fat_offset_sys);
         log_i("FATsize[1]: %d - max: %d at offset: %d", fat_size_vfs, MAX_FAT_vfs, fat_offset_vfs);
 
-        if (!file.seek(0x10000)) goto Exit;
-        performUpdate(file, app_size, U_FLASH);
+        if (!seekTo(0x10000)) goto Exit;
+        performUpdate(*source, app_size, U_FLASH, layout.sha256);
 
         prog_handler = 1; // Install SPIFFS update
         if (spiffs) {
-            if (!file.seek(spiffs_offset)) goto Exit;
-            performUpdate(file, spiffs_size, U_SPIFFS);
+            if (!seekTo(spiffs_offset)) goto Exit;
+            performUpdate(*source, spiffs_size, U_SPIFFS);
         }
 
         if (fat) {
             displayRedStripe("Formating FAT");
             if (fat_size_sys > 0) {
-                if (!file.seek(fat_offset_sys)) goto Exit;
-                if (!performFATUpdate(file, fat_size_sys, "sys")) log_i("FAIL updating FAT sys");
+                if (!seekTo(fat_offset_sys)) goto Exit;
+                if (!performFATUpdate(*source, fat_size_sys, "sys")) log_i("FAIL updating FAT sys");
                 else displayRedStripe("sys FAT complete");
             }
             displayRedStripe("Formating FAT");
             if (fat_size_vfs > 0) {
-                if (!file.seek(fat_offset_vfs)) goto Exit;
-                if (!performFATUpdate(file, fat_size_vfs, "vfs")) log_i("FAIL updating FAT vfs");
+                if (!seekTo(fat_offset_vfs)) goto Exit;
+                if (!performFATUpdate(*source, fat_size_vfs, "vfs")) log_i("FAIL updating FAT vfs");
                 else displayRedStripe("vfs FAT complete");
             }
         }
+        // the gzip CRC covers the SPIFFS and FAT regions too, they have no digest of their own
+        if (layout.compressed && !gz.finished()) goto GzFail;
         displayRedStripe("Complete");
         delay(1000);
-        FREE_TFT
-#if CONFIG_IDF_TARGET_ESP32P4
-        const esp_partition_t *partition =
-            esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-        esp_ota_set_boot_partition(partition);
-        ESP.deepSleep(100);
-#endif
-        ESP.restart();
+        startInstalledApp();
     }
+GzFail:
+    displayRedStripe("Image CRC failed");
+    delay(2500);
 Exit:
     displayRedStripe("Update Error.");
     delay(2500);
@@ -667,18 +731,13 @@ Exit:
 
 /***************************************************************************************
 ** Function name: performFATUpdate
-** Description:   this function performs the update
+** Description:   this function performs the update of a FAT partition, through
+**                Update: blocks are erased as they are reached, sectors already
+**                in flash and empty ones aren't written, the rest in large runs
 ***************************************************************************************/
-uint8_t buffer2[1024];
-
 bool performFATUpdate(Stream &updateSource, size_t updateSize, const char *label) {
-    // Preencher o buffer com 0xFF
-    memset(buffer2, 0x00, sizeof(buffer2));
-    const esp_partition_t *partition;
     esp_err_t error;
-    size_t paroffset = 0;
-    int written = 0;
-    int bytesRead = 0;
+    size_t written = 0;
     error = esp_flash_set_chip_write_protect(NULL, false);
 
     if (error != ESP_OK) {
@@ -686,19 +745,9 @@ bool performFATUpdate(Stream &updateSource, size_t updateSize, const char *label
         // return false;
     }
 
-    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, label);
-    if (!partition) {
-        error = UPDATE_ERROR_NO_PARTITION;
-        return false;
-    }
-
-    log_i("Start updating: %s", partition->label);
-    paroffset = partition->address;
-    log_i("Erasing updating: %s from: %d with size: %d", label, paroffset, updateSize);
-
-    error = esp_flash_erase_region(NULL, partition->address, updateSize);
-    if (error != ESP_OK) {
-        log_i("Erase error %d", error);
+    log_i("Start updating: %s with size: %d", label, updateSize);
+    if (!Update.begin(updateSize, U_FAT, -1, LOW, label)) {
+        log_i("FAT partition %s: %s", label, Update.errorString());
         return false;
     }
 
@@ -706,23 +755,21 @@ bool performFATUpdate(Stream &updateSource, size_t updateSize, const char *label
     displayRedStripe("Updating FAT");
     log_i("Updating updating: %s", label);
 
-    while (written < updateSize) { // updateSource.available() &&
-        bytesRead = updateSource.readBytes(buffer2, sizeof(buffer2));
-        error = esp_flash_write(NULL, buffer2, paroffset, bytesRead);
-        if (error != ESP_OK) {
-            log_i("[FLASH] Failed to write to flash (0x%x)", error);
-            return false;
-        }
-        if (bytesRead == 0) break; // Evitar loop infinito se não houver bytes para ler
-        paroffset += bytesRead;
-        written += bytesRead;
+    pipelineTransfer(updateSource, updateSize, [&](uint8_t *data, size_t len) {
+        size_t w = Update.write(data, len);
+        written += w;
         progressHandler(written, updateSize);
-    }
-
-    if (written == updateSize) {
-        log_i("Success updating %s", label);
+        return w == len;
+    });
+
+    if (written == updateSize && Update.end()) {
+        log_i(
+            "Success updating %s, sectors written: %d, unchanged: %d", label, Update.writtenSectors(),
+            Update.skippedSectors()
+        );
     } else {
-        log_i("FAIL updating %s", label);
+        log_i("FAIL updating %s: %s", label, Update.errorString());
+        Update.abort();
         return false;
     }
 
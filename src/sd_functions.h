@@ -30,7 +30,7 @@ bool sortList(const Option &a, const Option &b);
 
 String loopSD(bool filePicker = false);
 
-void performUpdate(Stream &updateSource, size_t updateSize, int command);
+bool performUpdate(Stream &updateSource, size_t updateSize, int command, const String &sha256 = "");
 
 void updateFromSD(String path);
 
@@ -38,4 +38,6 @@ bool performFATUpdate(Stream &updateSource, size_t updateSize, const char *label
 
 bool clearCoredump();
 
+void startInstalledApp();
+
 #endif
@@ -1,6 +1,7 @@
 
 #include "settings.h"
 #include "display.h"
+#include "fwSlots.h"
 #include "esp_mac.h"
 #include "mykeyboard.h"
 #include "nvs.h"
@@ -8,6 +9,7 @@
 #include "onlineLauncher.h"
 #include "partitioner.h"
 #include "sd_functions.h"
+#include "trace.h"
 #include <cstdio>
 #include <cstdlib>
 #include <globals.h>
@@ -158,6 +160,10 @@ void settings_menu() {
                                gsetAskSpiffs(true, true);
                                saveConfigs();
                            }});
+    options.push_back({fastBoot ? "Fast Boot Off" : "Fast Boot On", [=]() {
+                           fastBoot = !fastBoot;
+                           saveConfigs();
+                       }});
 #if !defined(E_PAPER_DISPLAY) || defined(USE_M5GFX)
     options.push_back({"Orientation", [=]() {
                            gsetRotation(true);
@@ -183,6 +189,13 @@ void settings_menu() {
     if (MAX_FAT_sys > 0 && dev_mode)
         options.push_back({"Restore FAT Sys", [=]() { restorePartition("sys"); }}); // Test only
     if (MAX_FAT_vfs > 0) options.push_back({"Restore FAT Vfs", [=]() { restorePartition("vfs"); }});
+    if (slotsAvailable()) options.push_back({"Firmware Slots", [=]() { slotsMenu(); }});
+#ifdef LAUNCHER_TRACE
+    options.push_back({"Save Trace", [=]() {
+                           displayRedStripe(traceSave() ? "Saved " TRACE_FILE : "SD Card Error");
+                           delay(1500);
+                       }});
+#endif
     if (dev_mode) options.push_back({"Boot Animation", [=]() { initDisplayLoop(); }});
     if (dev_mode) options.push_back({"Deactivate Dev", [=]() { dev_mode = false; }});
     options.push_back({"Restart", [=]() { FREE_TFT ESP.restart(); }});
@@ -276,6 +289,22 @@ bool gsetAskSpiffs(bool set, bool value) {
     return result;
 }
 
+// Kept across software restarts only, random after power on: the magic tells them apart
+#define STAY_MAGIC 0x4C415354
+RTC_NOINIT_ATTR static uint32_t stayFlag;
+
+/*********************************************************************
+**  Function: stayInLauncher
+**  the next boot opens the Launcher even with fast boot on
+**********************************************************************/
+void stayInLauncher() { stayFlag = STAY_MAGIC; }
+
+bool takeStayInLauncher() {
+    bool stay = stayFlag == STAY_MAGIC;
+    stayFlag = 0;
+    return stay;
+}
+
 /*********************************************************************
 **  Function: gsetRotation
 **  get onlyBins from EEPROM
@@ -451,6 +480,31 @@ void chargeMode() {
 #endif
     setBrightness(bright, false);
 }
+
+/***************************************************************************************
+** Function name: joinList / splitList
+** Description:   mirror lists are kept in NVS as one space separated string
+***************************************************************************************/
+static String joinList(const std::vector<String> &list) {
+    String joined = "";
+    for (const String &item : list) {
+        if (joined != "") joined += " ";
+        joined += item;
+    }
+    return joined;
+}
+static std::vector<String> splitList(String joined) {
+    std::vector<String> list;
+    joined.trim();
+    while (joined.length() > 0) {
+        int sep = joined.indexOf(' ');
+        if (sep < 0) sep = joined.length();
+        if (sep > 0) list.push_back(joined.substring(0, sep));
+        joined = joined.substring(sep + 1);
+    }
+    return list;
+}
+
 String get_efuse_mac_as_string() {
     uint8_t mac[6] = {0};
     String str = "";
@@ -494,6 +548,7 @@ bool saveIntoNVS() {
     err |= nvsHandle->set_item("bright", bright);
     err |= nvsHandle->set_item("onlyBins", onlyBins);
     err |= nvsHandle->set_item("askSpiffs", askSpiffs);
+    err |= nvsHandle->set_item("fastBoot", fastBoot);
     err |= nvsHandle->set_item("rotation", rotation);
     err |= nvsHandle->set_item("FGCOLOR", FGCOLOR);
     err |= nvsHandle->set_item("BGCOLOR", BGCOLOR);
@@ -505,6 +560,8 @@ bool saveIntoNVS() {
     err |= nvsHandle->set_string("wui_pwd", wui_pwd.c_str());
     err |= nvsHandle->set_string("dwn_path", dwn_path.c_str());
     err |= nvsHandle->set_string("hub_url", hub_url.c_str());
+    err |= nvsHandle->set_string("hub_mirrors", joinList(hub_mirrors).c_str());
+    err |= nvsHandle->set_string("cdn_mirrors", joinList(cdn_mirrors).c_str());
 #if defined(HEADLESS)
     // SD Pins
     err |= nvsHandle->set_item("miso", _miso);
@@ -589,6 +646,7 @@ void defaultValues() {
     bright = 100;
     onlyBins = true;
     askSpiffs = true;
+    fastBoot = false;
 #if defined(E_PAPER_DISPLAY) && defined(USE_M5GFX)
     FGCOLOR = 0x0000;
     BGCOLOR = 0xFFFF;
@@ -607,6 +665,8 @@ void defaultValues() {
     wui_pwd = "launcher";
     dwn_path = "/downloads/";
     hub_url = "https://einkhub.com";
+    hub_mirrors.clear();
+    cdn_mirrors.clear();
 #if defined(HEADLESS)
     // SD Pins
     _miso = 0;
@@ -658,6 +718,11 @@ bool getFromNVS() {
     if (nvsHandle->get_string("hub_url", buffer, sizeof(buffer)) == ESP_OK) {
         hub_url = String(buffer);
     }
+    // added later than the rest, missing on older installs
+    if (nvsHandle->get_item("fastBoot", fastBoot) != ESP_OK) fastBoot = false;
+    char list[256];
+    if (nvsHandle->get_string("hub_mirrors", list, sizeof(list)) == ESP_OK) hub_mirrors = splitList(list);
+    if (nvsHandle->get_string("cdn_mirrors", list, sizeof(list)) == ESP_OK) cdn_mirrors = splitList(list);
     if (err != ESP_OK) {
         log_i("Failed to retrieve settings from NVS: %d\nUsing Default values", err);
         defaultValues();
@@ -751,6 +816,7 @@ bool getWifiFromNVS() {
 **  getConfigurations from EEPROM or JSON
 **********************************************************************/
 void getConfigs() {
+    TRACE_SPAN("getConfigs");
     if (setupSdCard()) {
         // check if config file exists, otherwise create it with default values
         config_exists();
@@ -778,6 +844,7 @@ void getConfigs() {
                 count++;
                 log_i("Fail");
             }
+            if (setting["fastBoot"].is<bool>()) fastBoot = setting["fastBoot"].as<bool>();
             if (setting["bright"].is<int>()) {
                 bright = setting["bright"].as<int>();
             } else {
@@ -859,6 +926,11 @@ void getConfigs() {
                 count++;
                 log_i("Fail");
             }
+            // optional, most setups have a single hub
+            hub_mirrors.clear();
+            for (JsonVariant m : setting["hub_mirrors"].as<JsonArray>()) hub_mirrors.push_back(m.as<String>());
+            cdn_mirrors.clear();
+            for (JsonVariant m : setting["cdn_mirrors"].as<JsonArray>()) cdn_mirrors.push_back(m.as<String>());
             if (!setting["wifi"].is<JsonArray>()) {
                 ++count;
                 log_i("Fail");
@@ -946,6 +1018,7 @@ void saveConfigs() {
         // Update JSON document with current configuration
         setting["onlyBins"] = onlyBins;
         setting["askSpiffs"] = askSpiffs;
+        setting["fastBoot"] = fastBoot;
         setting["bright"] = bright;
         setting["dimmerSet"] = dimmerSet;
         setting[get_efuse_mac_as_string()] = rotation;
@@ -959,6 +1032,10 @@ void saveConfigs() {
         setting["wui_pwd"] = wui_pwd;
         setting["dwn_path"] = dwn_path;
         setting["hub_url"] = hub_url;
+        JsonArray hubList = setting["hub_mirrors"].to<JsonArray>();
+        for (const String &m : hub_mirrors) hubList.add(m);
+        JsonArray cdnList = setting["cdn_mirrors"].to<JsonArray>();
+        for (const String &m : cdn_mirrors) cdnList.add(m);
 
         File file = SDM.open(CONFIG_FILE, FILE_WRITE, true);
         if (!file) {
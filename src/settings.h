@@ -15,6 +15,7 @@ config.conf JSON structure
       "onlyBins":1,
       "bright":100,
       "askSpiffs":1,
+      "fastBoot":0,
       "wui_usr":"admin",
       "wui_pwd":"launcher",
       "dwn_path": "/downloads/",
@@ -40,6 +41,8 @@ void setBrightness(int bright, bool save = true);
 void getBrightness();
 bool gsetOnlyBins(bool set = false, bool value = true);
 bool gsetAskSpiffs(bool set = false, bool value = true);
+void stayInLauncher();
+bool takeStayInLauncher();
 int gsetRotation(bool set = false);
 void getConfigs();
 void saveConfigs();
@@ -1,5 +1,6 @@
 #ifndef __TFT_H
 #define __TFT_H
+#include "trace.h"
 #if defined(E_PAPER_DISPLAY) && !defined(GxEPD2_DISPLAY) && !defined(USE_M5GFX)
 #include <EPD_translate.h>
 #define DARKGREY TFT_DARKGREY
@@ -56,6 +57,11 @@ private:
 #define DARKCYAN 0x6666
 #define LIGHTGREY 0x4444
 
+// Fast partial refreshes between two full ones, which clear the ghosting they leave
+#ifndef EPD_PARTIAL_MAX
+#define EPD_PARTIAL_MAX 8
+#endif
+
 #if defined(XTEINK_X4)
 using GxEpdPanel = GxEPD2_426_GDEQ0426T82;
 #else
@@ -77,6 +83,22 @@ public:
 #endif
         setFullWindow();
     }
+    void display(bool partial_update_mode = false) {
+        TRACE_SPAN("epd refresh");
+        GxEPD2_BW<GxEpdPanel, GxEpdPanel::HEIGHT>::display(partial_update_mode);
+        if (!partial_update_mode) _partials = 0;
+        _refreshes++;
+    }
+    // Sends a window of the buffer with a fast partial refresh, or the whole buffer with
+    // a full one once EPD_PARTIAL_MAX partial refreshes were made since the last
+    void displayPartial(int16_t x, int16_t y, int16_t w, int16_t h) {
+        if (++_partials > EPD_PARTIAL_MAX) return display(false);
+        TRACE_SPAN("epd partial");
+        displayWindow(x, y, w, h);
+        _refreshes++;
+    }
+    // Changes each time the panel is refreshed, to tell whether it still shows a frame
+    inline uint32_t refreshes() const { return _refreshes; }
     inline void drawChar2(int16_t x, int16_t y, char c, int16_t a, int16_t b) {
         drawChar(x, y, c, a, b, textsize_x);
     };
@@ -90,6 +112,10 @@ public:
 
     void stopCallback() { setFullWindow(); };
     void startCallback() {};
+
+private:
+    uint8_t _partials = 0;
+    uint32_t _refreshes = 0;
 };
 
 #elif defined(HEADLESS)
@@ -244,6 +270,7 @@ public:
     void stopCallback() {};
     void startCallback() {};
     void display(bool a = false) {
+        TRACE_SPAN("epd refresh");
         sprite.pushSprite(0, 0);
 #if defined(ARDUINO_M5STACK_PAPER)
         sprite.deleteSprite();
@@ -0,0 +1,96 @@
+#include "trace.h"
+#ifdef LAUNCHER_TRACE
+#include "sd_functions.h"
+#include <algorithm>
+#include <globals.h>
+#include <vector>
+
+#define TRACE_MAGIC 0x54524331 // "TRC1"
+
+struct TraceRing {
+    uint32_t magic;
+    uint32_t boot;
+    uint32_t next;  // entry written next
+    uint32_t count; // entries in use
+    TraceEntry entries[TRACE_ENTRIES];
+};
+
+// Kept across software restarts, random after power on: magic and indexes tell them apart
+RTC_NOINIT_ATTR static TraceRing ring;
+// spans also end in other tasks (SD reader, input handler)
+static portMUX_TYPE traceLock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool ringValid() {
+    return ring.magic == TRACE_MAGIC && ring.next < TRACE_ENTRIES && ring.count <= TRACE_ENTRIES;
+}
+
+void traceBegin() {
+    if (!ringValid()) {
+        memset(&ring, 0, sizeof(ring));
+        ring.magic = TRACE_MAGIC;
+    }
+    ring.boot++;
+}
+
+static void traceAdd(const char *name, int64_t start, int64_t end) {
+    if (!ringValid()) traceBegin();
+    taskENTER_CRITICAL(&traceLock);
+    TraceEntry &entry = ring.entries[ring.next];
+    strncpy(entry.name, name, sizeof(entry.name) - 1);
+    entry.name[sizeof(entry.name) - 1] = 0;
+    entry.start = start;
+    entry.duration = end - start;
+    entry.boot = ring.boot;
+    ring.next = (ring.next + 1) % TRACE_ENTRIES;
+    if (ring.count < TRACE_ENTRIES) ring.count++;
+    taskEXIT_CRITICAL(&traceLock);
+}
+
+TraceSpan::~TraceSpan() {
+    if (_name) traceAdd(_name, _start, esp_timer_get_time());
+}
+
+void traceMark(const char *name) {
+    int64_t now = esp_timer_get_time();
+    traceAdd(name, now, now);
+}
+
+/***************************************************************************************
+** Function name: traceDump
+** Description:   prints the ring by boot and start time, spans are kept as they end
+***************************************************************************************/
+void traceDump(Print &out) {
+    std::vector<TraceEntry> entries;
+    // no allocation with interrupts masked
+    entries.reserve(TRACE_ENTRIES);
+    if (ringValid()) {
+        taskENTER_CRITICAL(&traceLock);
+        uint32_t first = (ring.next + TRACE_ENTRIES - ring.count) % TRACE_ENTRIES;
+        for (uint32_t i = 0; i < ring.count; i++) entries.push_back(ring.entries[(first + i) % TRACE_ENTRIES]);
+        taskEXIT_CRITICAL(&traceLock);
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const TraceEntry &a, const TraceEntry &b) {
+        return a.boot != b.boot ? a.boot < b.boot : a.start < b.start;
+    });
+
+    out.printf("boot   start ms  duration ms  span\n");
+    for (const TraceEntry &entry : entries) {
+        out.printf(
+            "%4u %10.1f %12.1f  %s\n",
+            (unsigned)entry.boot,
+            entry.start / 1000.0,
+            entry.duration / 1000.0,
+            entry.name
+        );
+    }
+}
+
+bool traceSave(const char *path) {
+    if (!setupSdCard()) return false;
+    File file = SDM.open(path, FILE_WRITE);
+    if (!file) return false;
+    traceDump(file);
+    file.close();
+    return true;
+}
+#endif
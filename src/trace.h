@@ -0,0 +1,70 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+#include <Arduino.h>
+
+/*
+  Timing spans, built in with -DLAUNCHER_TRACE. TRACE_SPAN("name") times the scope
+  it is declared in with esp_timer_get_time() and keeps it in a ring in RTC memory,
+  which outlives software restarts: the timeline of the last boots, the restart into
+  the app included, can be read back from the Launcher with traceDump (serial),
+  traceSave (SD) and /trace in the WebUI. Without the flag the macros are empty.
+*/
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES 64
+#endif
+
+#ifndef TRACE_FILE
+#define TRACE_FILE "/launcher_trace.txt"
+#endif
+
+#ifdef LAUNCHER_TRACE
+#include <esp_timer.h>
+
+struct TraceEntry {
+    char name[20];
+    uint32_t start;    // us since the boot it was taken in
+    uint32_t duration; // us, 0 for marks
+    uint32_t boot;     // boot it was taken in, counted by traceBegin
+};
+
+class TraceSpan {
+public:
+    TraceSpan(const char *name, bool on = true) : _name(on ? name : nullptr), _start(esp_timer_get_time()) {}
+    ~TraceSpan();
+
+private:
+    const char *_name;
+    int64_t _start;
+};
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+// times the enclosing scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CAT(_traceSpan, __LINE__)(name)
+// same, only when on is true (for calls repeated in loops)
+#define TRACE_SPAN_IF(on, name) TraceSpan TRACE_CAT(_traceSpan, __LINE__)(name, on)
+// a point in time, for what ends with a restart
+#define TRACE_MARK(name) traceMark(name)
+
+// Counts the boot, clears the ring when it holds no timeline (power on)
+void traceBegin();
+
+void traceMark(const char *name);
+
+// Writes the timeline, oldest boot first
+void traceDump(Print &out);
+
+bool traceSave(const char *path = TRACE_FILE);
+#else
+#define TRACE_SPAN(name) \
+    do {                 \
+    } while (0)
+#define TRACE_SPAN_IF(on, name) \
+    do {                        \
+    } while (0)
+#define TRACE_MARK(name) \
+    do {                 \
+    } while (0)
+#endif
+
+#endif
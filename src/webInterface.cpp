@@ -2,11 +2,13 @@
 #include "webInterface.h"
 #include "display.h"
 #include "esp_ota_ops.h"
+#include "gzStream.h"
 #include "esp_task_wdt.h"
 #include "mykeyboard.h"
 #include "onlineLauncher.h"
 #include "sd_functions.h"
 #include "settings.h"
+#include "trace.h"
 #include <globals.h>
 #include <map>
 
@@ -21,6 +23,8 @@ struct Config {
 // command = U_FLASH = 0
 int command = 0;
 bool updateFromSd_var = false;
+GzInflater *gzUpload = nullptr; // set while a compressed firmware is being uploaded
+bool uploadFailed = false;      // a write failed, the rest of the upload is dropped
 
 // WiFi as a Client
 const int default_webserverporthttp = 80;
@@ -227,14 +231,25 @@ void handleUpload(
                 }
             } else {
                 runOnce = false;
+                uploadFailed = false;
+                // compressed uploads are inflated on the fly, their final size is unknown
+                if (GzInflater::isGzip(data, len)) {
+                    gzUpload = new GzInflater();
+                    if (!gzUpload->begin()) {
+                        delete gzUpload;
+                        gzUpload = nullptr;
+                        displayRedStripe("FAIL: not enough memory");
+                    }
+                }
                 // open the file on first call and store the file handle in the request object
-                if (Update.begin(file_size, command)) {
+                if (Update.begin(gzUpload ? UPDATE_SIZE_UNKNOWN : file_size, command)) {
                     if (command == 0) prog_handler = 0;
                     else prog_handler = 1;
 
                     progressHandler(0, 500);
                     Update.onProgress(progressHandler);
                 } else {
+                    uploadFailed = true;
                     displayRedStripe("FAIL 160: " + String(Update.getError()));
                     delay(3000);
                 }
@@ -245,8 +260,18 @@ void handleUpload(
             // stream the incoming chunk to the opened file
             if (!update) {
                 request->_tempFile.write(data, len);
+            } else if (uploadFailed) {
+                // already reported, the image won't be committed
+            } else if (gzUpload) {
+                if (!gzUpload->write(data, len, [](uint8_t *d, size_t l) { return Update.write(d, l) == l; })) {
+                    uploadFailed = true;
+                    displayRedStripe("FAIL 170");
+                }
             } else {
-                if (!Update.write(data, len)) displayRedStripe("FAIL 170");
+                if (!Update.write(data, len)) {
+                    uploadFailed = true;
+                    displayRedStripe("FAIL 170");
+                }
             }
         }
 
@@ -256,8 +281,16 @@ void handleUpload(
                 request->_tempFile.close();
                 request->redirect("/");
             } else {
-
-                if (!Update.end()) {
+                // a truncated or corrupted gzip never reaches its trailer, nor a failed upload
+                bool complete = !uploadFailed && (!gzUpload || gzUpload->finished());
+                bool ended = false;
+                if (complete) ended = Update.end(gzUpload != nullptr);
+                else Update.abort();
+                if (gzUpload) {
+                    delete gzUpload;
+                    gzUpload = nullptr;
+                }
+                if (!ended) {
                     displayRedStripe("Fail 181: " + String(Update.getError()));
                     delay(3000);
                 } else {
@@ -433,6 +466,17 @@ void configureWebServer() {
         );
         request->send(200, "application/json", response_body);
     });
+#ifdef LAUNCHER_TRACE
+    server->on("/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+        if (checkUserWebAuth(request)) {
+            AsyncResponseStream *response = request->beginResponseStream("text/plain");
+            traceDump(*response);
+            request->send(response);
+        } else {
+            return request->requestAuthentication();
+        }
+    });
+#endif
     server->on("/reboot", HTTP_GET, [](AsyncWebServerRequest *request) {
         if (checkUserWebAuth(request)) {
             shouldReboot = true;
@@ -645,16 +689,7 @@ void startWebUi(String ssid, int encryptation, bool mode_ap) {
 #endif
 
     while (!check(SelPress)) {
-        if (shouldReboot) {
-            FREE_TFT
-#if CONFIG_IDF_TARGET_ESP32P4
-            const esp_partition_t *partition =
-                esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
-            esp_ota_set_boot_partition(partition);
-            ESP.deepSleep(100);
-#endif
-            ESP.restart();
-        }
+        if (shouldReboot) startInstalledApp();
         // Perform installation from SD Card
         if (updateFromSd_var) {
             // log_i("Starting Update from SD");
@@ -0,0 +1,98 @@
+/*
+  Host check for gzBitBufferBytes (src/gzBits.h), the part of GzInflater that takes
+  the first gzip trailer bytes out of the inflater bit buffer.
+
+    g++ -I src support_files/gz_trailer_check.cpp -lz -o gz_trailer_check && ./gz_trailer_check
+
+  Compresses a range of inputs, keeps the ones whose deflate data doesn't end on a
+  byte boundary, and for each read ahead the ROM inflater can leave behind (0 to 4
+  bytes) rebuilds its bit buffer and checks the trailer bytes come out aligned.
+*/
+#include "gzBits.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <zlib.h>
+
+static std::vector<uint8_t> deflateRaw(const std::vector<uint8_t> &data, int level) {
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> out(deflateBound(&s, data.size()) + 16);
+    s.next_in = (Bytef *)data.data();
+    s.avail_in = data.size();
+    s.next_out = out.data();
+    s.avail_out = out.size();
+    deflate(&s, Z_FINISH);
+    out.resize(s.total_out);
+    deflateEnd(&s);
+    return out;
+}
+
+// bits of the deflate data, from the unused bits zlib reports in its last byte when
+// it stops at the end of the final block (the Z_STREAM_END call doesn't report them)
+static size_t deflateBits(const std::vector<uint8_t> &deflated) {
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    inflateInit2(&s, -15);
+    std::vector<uint8_t> out(1 << 16);
+    s.next_in = (Bytef *)deflated.data();
+    s.avail_in = deflated.size();
+    int ret, unused = 0;
+    do {
+        s.next_out = out.data();
+        s.avail_out = out.size();
+        ret = inflate(&s, Z_BLOCK);
+        if (ret == Z_OK) unused = s.data_type & 7;
+    } while (ret == Z_OK);
+    size_t bits = s.total_in * 8 - unused;
+    inflateEnd(&s);
+    return ret == Z_STREAM_END ? bits : 0;
+}
+
+static uint8_t bitAt(const std::vector<uint8_t> &data, size_t bit) { return (data[bit / 8] >> (bit % 8)) & 1; }
+
+int main() {
+    int checked = 0, unaligned = 0, failed = 0;
+    srand(1);
+    for (int size = 1; size < 3000; size += 37) {
+        for (int level = 1; level <= 9; level += 4) {
+            std::vector<uint8_t> data(size);
+            for (int i = 0; i < size; i++) data[i] = (i % 7 == 0) ? rand() & 0xFF : 'a' + i % 5;
+            std::vector<uint8_t> stream = deflateRaw(data, level);
+            size_t end = deflateBits(stream);
+            if (!end) {
+                printf("size %d level %d: zlib can't read its own data\n", size, level);
+                return 1;
+            }
+            // gzip trailer: CRC32 and ISIZE, little endian
+            uint32_t crc = crc32(0, data.data(), data.size());
+            uint8_t trailer[8];
+            for (int i = 0; i < 4; i++) {
+                trailer[i] = crc >> (8 * i);
+                trailer[4 + i] = (uint32_t)size >> (8 * i);
+            }
+            stream.insert(stream.end(), trailer, trailer + 8);
+            if (end % 8) unaligned++;
+
+            for (uint32_t ahead = 0; ahead <= 4; ahead++) {
+                // the inflater has taken every byte up to the last deflate one, plus ahead more
+                uint32_t numBits = (8 - end % 8) % 8 + 8 * ahead;
+                uint64_t bitBuf = 0;
+                for (uint32_t b = 0; b < numBits; b++) bitBuf |= (uint64_t)bitAt(stream, end + b) << b;
+
+                uint8_t got[8];
+                size_t n = gzBitBufferBytes(bitBuf, numBits, got, sizeof(got));
+                checked++;
+                if (n != ahead || memcmp(got, trailer, n) != 0) {
+                    printf("size %d level %d: %u bytes ahead, %u padding bits, misaligned\n", size, level,
+                           ahead, (unsigned)(numBits & 7));
+                    failed++;
+                }
+            }
+        }
+    }
+    printf("%d cases, %d streams not ending on a byte boundary, %d failed\n", checked, unaligned, failed);
+    return failed || !unaligned;
+}
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""
+Builds a delta patch for the Launcher "Delta update" option.
+
+    python make_delta.py old.bin new.bin patch.ldp.gz
+
+old.bin is the app image the patch applies to, new.bin the app image it rebuilds.
+Merged images (bootloader + partition table + app) are accepted, the app is taken
+from 0x10000. Needs the bsdiff4 package (pip install bsdiff4).
+
+Publish the patch next to the full image, in the version entry of the new firmware:
+
+    "delta": [{"from": "<sha256 of the old version>", "file": "<patch url>", "size": <bytes>}]
+
+"from" is the "sha256" the catalog already gives for the old version.
+"""
+import gzip
+import hashlib
+import struct
+import sys
+
+from bsdiff4 import core
+
+APP_OFFSET = 0x10000
+MAGIC = b"LDP1"
+
+
+def app_image(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    # merged images have the partition table at 0x8000, the app starts at APP_OFFSET
+    if len(data) > APP_OFFSET + 24 and data[0x8000:0x8002] == b"\xaa\x50":
+        data = data[APP_OFFSET:]
+    if len(data) < 24 or data[0] != 0xE9:
+        sys.exit(f"{path} is not an app image")
+    # image length from its segments: checksum byte padded to 16, then the appended digest
+    length = 24
+    for _ in range(data[1]):
+        length += 8 + struct.unpack_from("<I", data, length + 4)[0]
+    length = (length + 1 + 15) & ~15
+    if data[23] == 1:
+        length += 32
+    return data[:length]
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit(__doc__)
+    old = app_image(sys.argv[1])
+    new = app_image(sys.argv[2])
+
+    control, diff, extra = core.diff(old, new)
+    out = bytearray(MAGIC)
+    out += struct.pack("<II", len(old), len(new))
+    out += hashlib.sha256(new).digest()
+    d = e = 0
+    for add, copy, seek in control:
+        out += struct.pack("<IIi", add, copy, seek)
+        out += diff[d : d + add]
+        out += extra[e : e + copy]
+        d += add
+        e += copy
+
+    patch = gzip.compress(bytes(out), 9)
+    with open(sys.argv[3], "wb") as f:
+        f.write(patch)
+    print(f"{len(new)} bytes image, {len(patch)} bytes patch ({len(new) / len(patch):.1f}x smaller)")
+
+
+if __name__ == "__main__":
+    main()